@@ -0,0 +1,574 @@
+/*
+ * Micro-benchmarks for the replfs data path.
+ *
+ * usage: bench [name]   (results go to stderr, run with > /dev/null
+ *                         to hide the library's debug output)
+ *        bench fec [port] [servers] [drop]
+ *                       (against servers already running with -drop)
+ *        bench queue    (cross-thread handoff under contention)
+ *        bench extmap   (rewrites staged through the extent map)
+ *        bench files [port] [servers] [drop]
+ *                       (threads committing their own files at once)
+ *        bench pipeline [port] [servers] [drop]
+ *                       (Commit vs. writing on behind CommitAsync)
+ */
+
+#define _GNU_SOURCE		/* kill() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "net.h"
+#include "utils.h"
+#include "protocol.h"
+#include "crc32c.h"
+#include "client.h"
+#include "cqueue.h"
+#include "cring.h"
+#include "extmap.h"
+
+#define BENCH_PORT    41099
+#define BENCH_GROUP   0xe0010101
+#define BENCH_SECONDS 2
+#define BENCH_SENDS   100000
+#define BENCH_COMMITS 50
+#define BENCH_WRITES  64		/* per commit */
+#define BENCH_BLOCK   512
+#define BENCH_HANDOFFS 1000000	/* per producer */
+#define BENCH_PRODUCERS 4
+#define BENCH_REWRITES 200000
+#define BENCH_SPAN    (64 * 1024)	/* file bytes the rewrites land in */
+
+static double
+elapsed_sec(struct timeval start)
+{
+  struct timeval now;
+  gettimeofday(&now,NULL);
+  struct timeval d = time_diff(now,start);
+  return d.tv_sec + (double) d.tv_usec / MICROSEC_IN_SEC;
+}
+
+/* floods the group with valid datagrams until killed */
+static void
+flood(unsigned short port)
+{
+  int s = socket(AF_INET,SOCK_DGRAM,0);
+  int loop = 1;
+  setsockopt(s,IPPROTO_IP,IP_MULTICAST_LOOP,&loop,sizeof(int));
+  struct sockaddr_in dest;
+  memset(&dest,0,sizeof(dest));
+  dest.sin_family = AF_INET;
+  dest.sin_port = htons(port);
+  dest.sin_addr.s_addr = htonl(BENCH_GROUP);
+
+  struct replfs_msg msg;
+  msg.msg_type = MsgDiscoverAck;
+  msg.len = sizeof(struct replfs_msg);
+  msg.cksum = checksum(&msg);
+  while (true)
+    sendto(s,&msg,msg.len,0,(struct sockaddr *)&dest,sizeof(dest));
+}
+
+static long
+recv_for(struct net_ring *ring, int seconds)
+{
+  long n = 0;
+  struct timeval start,deadline;
+  gettimeofday(&start,NULL);
+  while (elapsed_sec(start) < seconds) {
+    gettimeofday(&deadline,NULL);
+    deadline.tv_sec += 1;
+    if (netRecvBatch(ring,deadline) > 0)
+      while (netRingNext(ring,NULL,NULL))
+        n++;
+  }
+  return n;
+}
+
+/* datagrams per second, one syscall per message vs. batched */
+static int
+bench_net()
+{
+  if (netInit(BENCH_PORT,0))
+    return ErrorReturn;
+
+  struct replfs_msg msg;
+  msg.msg_type = MsgDiscover;
+  msg.len = sizeof(struct replfs_msg);
+  msg.cksum = checksum(&msg);
+
+  struct timeval start;
+  gettimeofday(&start,NULL);
+  for (int i=0; i<BENCH_SENDS; i++)
+    netSend(&msg,msg.len);
+  double single = BENCH_SENDS / elapsed_sec(start);
+
+  gettimeofday(&start,NULL);
+  netCork();
+  for (int i=0; i<BENCH_SENDS; i++)
+    netSend(&msg,msg.len);
+  netUncork();
+  double batched = BENCH_SENDS / elapsed_sec(start);
+
+  fprintf(stderr,"send: sendto %10.0f msg/s, sendmmsg %10.0f msg/s\n",
+          single,batched);
+
+  pid_t child = fork();
+  if (child == 0)
+    flood(BENCH_PORT);
+
+  struct net_ring *one = netRingCreate(1);
+  struct net_ring *many = netRingCreate(RECV_BATCH);
+  long n1 = recv_for(one,BENCH_SECONDS);
+  long nb = recv_for(many,BENCH_SECONDS);
+  kill(child,SIGKILL);
+  waitpid(child,NULL,0);
+
+  fprintf(stderr,"recv: recvfrom %10.0f msg/s, recvmmsg %10.0f msg/s\n",
+          (double) n1 / BENCH_SECONDS, (double) nb / BENCH_SECONDS);
+
+  netRingDispose(one);
+  netRingDispose(many);
+  netClose();
+  return NormalReturn;
+}
+
+/* linked with -Wl,--wrap=malloc so every allocation in the tree is counted */
+long nmallocs;
+void *__real_malloc(size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+  nmallocs++;
+  return __real_malloc(size);
+}
+
+/* allocations per send_* call on the outgoing path */
+static int
+bench_alloc()
+{
+  if (netInit(BENCH_PORT,0))
+    return ErrorReturn;
+
+  char data[64];
+  memset(data,'x',sizeof(data));
+  struct write_block wb;
+  wb.fd = 3;
+  wb.wid = 1;
+  wb.offset = 0;
+  wb.len = sizeof(data);
+  wb.data = data;
+  struct wid_range ranges[16];
+  for (int i=0; i<16; i++) {
+    ranges[i].from_wid = 2*i;
+    ranges[i].to_wid = 2*i;
+  }
+
+  const char *names[] = { "send_open", "send_generic_fd", 
+                          "send_generic_commit", "send_try_commit_fail",
+                          "send_write" };
+  for (int k=0; k<5; k++) {
+    long before = nmallocs;
+    struct timeval start;
+    gettimeofday(&start,NULL);
+    for (int i=0; i<BENCH_SENDS; i++) {
+      switch (k) {
+        case 0: send_open("bench.txt",3); break;
+        case 1: send_close_success(3,NULL); break;
+        case 2: send_commit_success(3,1,16,NULL); break;
+        case 3: send_try_commit_fail(3,0,31,ranges,16,NULL,0,NULL); break;
+        case 4: send_write(&wb); break;
+      }
+    }
+    double usec = elapsed_sec(start) * MICROSEC_IN_SEC / BENCH_SENDS;
+    fprintf(stderr,"%-22s %6.3f allocs/call %8.3f usec/call\n",names[k],
+            (double) (nmallocs - before) / BENCH_SENDS, usec);
+  }
+
+  netClose();
+  return NormalReturn;
+}
+
+/* the byte-at-a-time sum checksum() used before CRC32C */
+static int
+sum_bytes(const char *ptr, size_t len)
+{
+  int sum = 0;
+  for (size_t i=0; i < len; i++)
+    sum += ptr[i];
+  return sum;
+}
+
+/* MB/s of the old byte sum and CRC32C on 64B..64KB messages */
+static int
+bench_cksum()
+{
+  size_t maxlen = 64*1024;
+  char *buf = malloc(maxlen);
+  for (size_t i=0; i<maxlen; i++)
+    buf[i] = rand();
+
+  volatile uint32_t sink = 0;
+  for (size_t len=64; len<=maxlen; len*=4) {
+    long iters = (64L*1024*1024) / len;
+    struct timeval start;
+    gettimeofday(&start,NULL);
+    for (long i=0; i<iters; i++)
+      sink += sum_bytes(buf,len);
+    double sum_mbs = (double) iters*len / elapsed_sec(start) / (1<<20);
+
+    gettimeofday(&start,NULL);
+    for (long i=0; i<iters; i++)
+      sink += crc32c(0,buf,len);
+    double crc_mbs = (double) iters*len / elapsed_sec(start) / (1<<20);
+
+    fprintf(stderr,"%6zu bytes: sum %8.0f MB/s, crc32c %8.0f MB/s\n",
+            len,sum_mbs,crc_mbs);
+  }
+  free(buf);
+  return NormalReturn;
+}
+
+static char *bench_argv[3];
+
+/* 
+ * Commit latency at several FEC group sizes. The drop rate is whatever the
+ * servers were started with; pass the same to drop on the client's side.
+ */
+static int
+bench_fec()
+{
+  unsigned short port = bench_argv[0] ? atoi(bench_argv[0]) : 41056;
+  int nservers = bench_argv[1] ? atoi(bench_argv[1]) : 1;
+  int drop = bench_argv[2] ? atoi(bench_argv[2]) : 0;
+  if (InitReplFs(port,drop,nservers) != NormalReturn)
+    return ErrorReturn;
+
+  char block[BENCH_BLOCK];
+  memset(block,'f',sizeof(block));
+  int fd = OpenFile("bench-fec.txt");
+  if (fd < 0)
+    return ErrorReturn;
+  int ks[] = { 0, 16, 8, 4, 2 };
+  for (int k=0; k<sizeof(ks) / sizeof(ks[0]); k++) {
+    ReplFsSetFec(ks[k]);
+    double total = 0, worst = 0;
+    for (int c=0; c<BENCH_COMMITS; c++) {
+      struct timeval start;
+      gettimeofday(&start,NULL);
+      for (int i=0; i<BENCH_WRITES; i++)
+        WriteBlock(fd,block,i*BENCH_BLOCK,BENCH_BLOCK);
+      if (Commit(fd) != NormalReturn)
+        return ErrorReturn;
+      double ms = elapsed_sec(start) * MILLISEC_IN_SEC;
+      total += ms;
+      if (ms > worst)
+        worst = ms;
+    }
+    fprintf(stderr,"drop %2d%% k %2d: %8.3f ms/commit avg %8.3f ms worst\n",
+            drop,ks[k],total / BENCH_COMMITS,worst);
+  }
+  return CloseFile(fd);
+}
+
+#define BENCH_FILES 4
+
+/* one application thread, committing its own file */
+static void *
+commit_file_loop(void *aux)
+{
+  char name[32];
+  snprintf(name,sizeof(name),"bench-files-%ld.txt",(long) aux);
+  char block[BENCH_BLOCK];
+  memset(block,'a' + (long) aux,sizeof(block));
+  long failed = 0;
+  int fd = OpenFile(name);
+  if (fd < 0)
+    return (void *) 1;
+  for (int c=0; c<BENCH_COMMITS; c++) {
+    for (int i=0; i<BENCH_WRITES; i++)
+      WriteBlock(fd,block,i*BENCH_BLOCK,BENCH_BLOCK);
+    failed += Commit(fd) != NormalReturn;
+  }
+  failed += CloseFile(fd) != NormalReturn;
+  return (void *) failed;
+}
+
+/* commits per second with 1..BENCH_FILES threads, one file each */
+static int
+bench_files()
+{
+  unsigned short port = bench_argv[0] ? atoi(bench_argv[0]) : 41056;
+  int nservers = bench_argv[1] ? atoi(bench_argv[1]) : 1;
+  int drop = bench_argv[2] ? atoi(bench_argv[2]) : 0;
+  if (InitReplFs(port,drop,nservers) != NormalReturn)
+    return ErrorReturn;
+
+  for (int n=1; n<=BENCH_FILES; n*=2) {
+    pthread_t threads[BENCH_FILES];
+    struct timeval start;
+    gettimeofday(&start,NULL);
+    for (long t=0; t<n; t++)
+      pthread_create(&threads[t],NULL,commit_file_loop,(void *) t);
+    long failed = 0;
+    for (int t=0; t<n; t++) {
+      void *result;
+      pthread_join(threads[t],&result);
+      failed += (long) result;
+    }
+    fprintf(stderr,"%d file(s): %8.1f commits/s, %ld failed\n",n,
+            n * BENCH_COMMITS / elapsed_sec(start),failed);
+    if (failed)
+      return ErrorReturn;
+  }
+  return NormalReturn;
+}
+
+struct pipeline {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int outstanding;
+  int failed;
+};
+
+static void
+pipeline_done(int fd, int result, void *ctx)
+{
+  struct pipeline *p = (struct pipeline *) ctx;
+  pthread_mutex_lock(&p->lock);
+  p->failed += result != NormalReturn;
+  p->outstanding--;
+  pthread_cond_signal(&p->done);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* commits per second on one file, waiting on each vs. keeping on writing */
+static int
+bench_pipeline()
+{
+  unsigned short port = bench_argv[0] ? atoi(bench_argv[0]) : 41056;
+  int nservers = bench_argv[1] ? atoi(bench_argv[1]) : 1;
+  int drop = bench_argv[2] ? atoi(bench_argv[2]) : 0;
+  if (InitReplFs(port,drop,nservers) != NormalReturn)
+    return ErrorReturn;
+  int fd = OpenFile("bench-pipeline.txt");
+  if (fd < 0)
+    return ErrorReturn;
+
+  char block[BENCH_BLOCK];
+  memset(block,'p',sizeof(block));
+  struct pipeline p = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+  for (int async=0; async<2; async++) {
+    struct timeval start;
+    gettimeofday(&start,NULL);
+    for (int c=0; c<BENCH_COMMITS; c++) {
+      for (int i=0; i<BENCH_WRITES; i++)
+        WriteBlock(fd,block,i*BENCH_BLOCK,BENCH_BLOCK);
+      if (!async) {
+        p.failed += Commit(fd) != NormalReturn;
+        continue;
+      }
+      pthread_mutex_lock(&p.lock);
+      p.outstanding++;
+      pthread_mutex_unlock(&p.lock);
+      if (CommitAsync(fd,pipeline_done,&p) != NormalReturn)
+        return ErrorReturn;
+    }
+    pthread_mutex_lock(&p.lock);
+    while (p.outstanding)
+      pthread_cond_wait(&p.done,&p.lock);
+    pthread_mutex_unlock(&p.lock);
+    fprintf(stderr,"%-11s %8.1f commits/s, %d failed\n",
+            async ? "CommitAsync" : "Commit",
+            BENCH_COMMITS / elapsed_sec(start),p.failed);
+  }
+  if (CloseFile(fd) != NormalReturn || p.failed)
+    return ErrorReturn;
+  return NormalReturn;
+}
+
+/* 
+ * Ops per second through CQueue with 1..BENCH_PRODUCERS producers, against
+ * the same intrusive list behind a mutex, and through a CRing.
+ */
+struct handoff_bench {
+  bool locked;
+  CQueue queue;
+  pthread_mutex_t lock;
+  CQueueNode *head, *tail;
+  CRing *ring;
+  CQueueNode *nodes;
+};
+
+static void
+locked_push(struct handoff_bench *hb, CQueueNode *node)
+{
+  node->next = NULL;
+  pthread_mutex_lock(&hb->lock);
+  if (hb->tail)
+    hb->tail->next = node;
+  else
+    hb->head = node;
+  hb->tail = node;
+  pthread_mutex_unlock(&hb->lock);
+}
+
+static CQueueNode *
+locked_pop(struct handoff_bench *hb)
+{
+  pthread_mutex_lock(&hb->lock);
+  CQueueNode *node = hb->head;
+  if (node && !(hb->head = node->next))
+    hb->tail = NULL;
+  pthread_mutex_unlock(&hb->lock);
+  return node;
+}
+
+struct producer {
+  struct handoff_bench *hb;
+  int id;
+};
+
+static void *
+produce(void *aux)
+{
+  struct producer *p = (struct producer *) aux;
+  struct handoff_bench *hb = p->hb;
+  CQueueNode *nodes = hb->nodes + (long) p->id * BENCH_HANDOFFS;
+  for (long i=0; i<BENCH_HANDOFFS; i++) {
+    if (hb->ring) {
+      while (!CRingPush(hb->ring,&i))
+        sched_yield();
+    } else if (hb->locked) {
+      locked_push(hb,&nodes[i]);
+    } else {
+      CQueuePush(&hb->queue,&nodes[i]);
+    }
+  }
+  return NULL;
+}
+
+static double
+run_handoff(struct handoff_bench *hb, int nproducers)
+{
+  CQueueInit(&hb->queue);
+  pthread_mutex_init(&hb->lock,NULL);
+  hb->head = hb->tail = NULL;
+
+  struct producer producers[BENCH_PRODUCERS];
+  pthread_t threads[BENCH_PRODUCERS];
+  struct timeval start;
+  gettimeofday(&start,NULL);
+  for (int p=0; p<nproducers; p++) {
+    producers[p].hb = hb;
+    producers[p].id = p;
+    pthread_create(&threads[p],NULL,produce,&producers[p]);
+  }
+
+  long total = (long) nproducers * BENCH_HANDOFFS;
+  for (long n=0; n<total; ) {
+    long item;
+    bool got = hb->ring ? CRingPop(hb->ring,&item) :
+               hb->locked ? locked_pop(hb) != NULL : 
+               CQueuePop(&hb->queue) != NULL;
+    if (got)
+      n++;
+    else
+      sched_yield();
+  }
+  double ops = total / elapsed_sec(start);
+  for (int p=0; p<nproducers; p++)
+    pthread_join(threads[p],NULL);
+  return ops;
+}
+
+static int
+bench_queue()
+{
+  struct handoff_bench hb;
+  memset(&hb,0,sizeof(hb));
+  hb.nodes = malloc(sizeof(CQueueNode) * BENCH_PRODUCERS * BENCH_HANDOFFS);
+  if (!hb.nodes)
+    return ErrorReturn;
+
+  for (int p=1; p<=BENCH_PRODUCERS; p*=2) {
+    hb.locked = true;
+    double locked = run_handoff(&hb,p);
+    hb.locked = false;
+    double lockfree = run_handoff(&hb,p);
+    fprintf(stderr,"%d producer(s): mutex list %10.0f ops/s, "
+            "cqueue %10.0f ops/s\n",p,locked,lockfree);
+  }
+
+  hb.ring = CRingCreate(sizeof(long),1024);
+  fprintf(stderr,"1 producer:    cring      %10.0f ops/s\n",
+          run_handoff(&hb,1));
+  CRingDispose(hb.ring);
+  free(hb.nodes);
+  return NormalReturn;
+}
+
+/* staging rate and bytes held for writes that keep landing on the same span */
+static int
+bench_extmap()
+{
+  ExtMap *em = ExtMapCreate();
+  char block[BENCH_BLOCK];
+  memset(block,'x',sizeof(block));
+  srand(1);
+  long staged = 0;
+  struct timeval start;
+  gettimeofday(&start,NULL);
+  for (int i=0; i<BENCH_REWRITES; i++) {
+    int len = 1 + rand() % BENCH_BLOCK;
+    ExtMapWrite(em,rand() % (BENCH_SPAN - len),block,len);
+    staged += len;
+  }
+  double rate = BENCH_REWRITES / elapsed_sec(start);
+  fprintf(stderr,"extmap: %10.0f writes/s, %ld bytes staged, %ld held "
+          "in %d extent(s)\n",rate,staged,ExtMapBytes(em),ExtMapCount(em));
+  ExtMapDispose(em);
+  return NormalReturn;
+}
+
+struct bench {
+  const char *name;
+  int (*fn)();
+  bool on_demand;		/* needs servers, only run by name */
+};
+
+static struct bench benches[] = {
+  { "net", bench_net, false },
+  { "alloc", bench_alloc, false },
+  { "cksum", bench_cksum, false },
+  { "fec", bench_fec, true },
+  { "queue", bench_queue, false },
+  { "files", bench_files, true },
+  { "pipeline", bench_pipeline, true },
+  { "extmap", bench_extmap, false },
+};
+
+int
+main(int argc, char *argv[])
+{
+  for (int i=2; i<argc && i-2 < 3; i++)
+    bench_argv[i-2] = argv[i];
+
+  int nbenches = sizeof(benches) / sizeof(benches[0]);
+  for (int i=0; i<nbenches; i++)
+    if ((argc < 2 && !benches[i].on_demand) || 
+        (argc >= 2 && !strcmp(argv[1],benches[i].name)))
+      if (benches[i].fn() != NormalReturn)
+        return ErrorReturn;
+  return NormalReturn;
+}
@@ -6,6 +6,9 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include "client.h"
 #include <netinet/in.h>
 
@@ -15,12 +18,10 @@
 #include "cvector.h"
 #include "utils.h"
 #include "clist.h"
+#include "rtt.h"
+#include "extmap.h"
 
 #define TIMEOUT_CONNECT     1000
-#define TIMEOUT_OPEN        1000
-#define TIMEOUT_CLOSE       1000
-#define TIMEOUT_TRY_COMMIT  1000
-#define TIMEOUT_COMMIT      1000
 
 #define RETRY_CONNECT     10
 #define RETRY_TRY_COMMIT  50
@@ -28,21 +29,155 @@
 #define RETRY_OPEN        10
 #define RETRY_CLOSE       100
 
-CVector *servers;
-CVector *wlog;
+/* how long a staged write may wait for others to share its datagram */
+#define WRITE_COALESCE_MS   10
+
+/* 
+ * requests for a block resent this recently are for the same loss, from 
+ * another server; shorter than the server's NACK interval and RTO_MIN_MS
+ */
+#define REPAIR_WINDOW_MS    5
+
+/* most writes one parity block protects */
+#define FEC_MAX_K           64
+
+/* compared by address, the first member, as a sockaddr_in */
+struct server {
+  struct sockaddr_in addr;
+  struct rtt rtt;
+};
+
+/* 
+ * A write in the log, freed by wbfree like the block it starts with. It 
+ * keeps its own data only until it first goes out, or for good when a 
+ * parity group covers it, since servers rebuild losses against the bytes
+ * as sent.
+ */
+struct staged_write {
+  struct write_block wb;
+  struct timeval resent;
+};
+
+/* 
+ * A transaction's writes: what each wid covered, in wid order, and the 
+ * bytes that survive them. Repairs of a write whose data is gone are cut
+ * from the extent map; wherever that differs from what went out, a later
+ * wid of the same transaction overwrites it.
+ */
+struct write_log {
+  CVector *writes;		/* struct staged_write */
+  ExtMap *bytes;
+};
 
-int widcount = 1;
+/* a server reply, routed to the file or commit it is about */
+struct mail {
+  struct sockaddr_in sender;
+  char buf[BUFFER_SIZE];
+};
+
+struct mailbox {
+  CVector *mail;		/* struct mail, in arrival order */
+  pthread_cond_t ready;
+  bool kicked;			/* wakes the waiter without mail */
+};
+
+/* 
+ * An open file, each with its own wid space and staged writes. Calls on
+ * one file hold its lock throughout, calls on different files run in 
+ * parallel.
+ */
+struct open_file {
+  int fd;
+  uint32_t group;		/* the file's multicast group */
+  int widcount;
+  struct write_log *wlog;
+  struct write_batch pending;
+  struct timeval pending_since;
+  int fec_k;			/* as of the last write */
+  struct write_parity parity;
+  pthread_mutex_t lock;
+  struct mailbox box;
+  bool closing;			/* lock_file() refuses it, under state_lock */
+  int waiters;			/* threads in lock_file() for it */
+  pthread_cond_t unused;	/* the last waiter has gone */
+};
+
+/* 
+ * A transaction on its way through both phases, on the commit thread. 
+ * It owns the staged writes it covers, so the file can stage the next 
+ * transaction meanwhile. Commits on one fd run in the order queued.
+ */
+struct commit_op {
+  int fd;
+  uint32_t group;
+  struct write_log *wlog;
+  int first_wid;
+  int last_wid;
+  bool started;
+  bool committing;		/* in the second phase */
+  bool refused;			/* a server turned the phase down */
+  int tries;			/* of the current phase */
+  CVector *responders;
+  struct wid_set *missing;
+  struct timeval sent;
+  struct timeval deadline;
+  bool done;
+  int result;
+  ReplFsCommitFn cb;
+  void *ctx;
+};
+
+CVector *servers;
+struct net_ring *inbox;
+
+/* 
+ * Guards the open files, their mailboxes, the servers' RTT estimates and
+ * group memberships. Taken after a file's lock, never before.
+ */
+pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+CVector *files;			/* struct open_file * */
+int group_users[FILE_GROUPS];
+CVector *ops;			/* struct commit_op *, in the order queued */
+struct mailbox commit_box;
+pthread_t committer;
+bool committer_running;
+bool stopping;			/* the commit thread exits once ops are done */
+
+/* 
+ * One thread at a time receives for all of them and routes the replies,
+ * the others wait on their file's mail condition.
+ */
+bool reading;
+struct net_loop *loop;
+int deadline_timer;
+int kick_fd;			/* wakes the receiving thread */
+
+/* blocks per parity block, 0 when FEC is off */
+int fec_k;
+
+int next_wid(struct open_file *f){
+  return f->widcount++;
+}
 
-int next_wid(){
-  return widcount++;
+void
+dispose_log(struct write_log *wlog)
+{
+  CVectorDispose(wlog->writes);
+  ExtMapDispose(wlog->bytes);
+  free(wlog);
 }
 
 void
-reset_log()
+reset_log(struct open_file *f)
 {
-  if (wlog)
-    CVectorDispose(wlog);
-  wlog = NULL;
+  batch_init(&f->pending);
+  parity_init(&f->parity);
+  if (f->wlog)
+    dispose_log(f->wlog);
+  f->wlog = malloc(sizeof(struct write_log));
+  assert(f->wlog);
+  f->wlog->writes = CVectorCreate(sizeof(struct staged_write),0,wbfree);
+  f->wlog->bytes = ExtMapCreate();
 }
 
 void 
@@ -104,16 +239,15 @@ known_server(struct sockaddr_in *s)
 int 
 locate_servers(int numServers, long timeout_ms)
 {
-  char buf[BUFFER_SIZE];
   struct replfs_msg *msg;
 
   /* send discover message */
   send_discover();
 
   /* gather responses */
-  struct timeval deadline,now;
-  gettimeofday(&now,NULL);
-  deadline = compute_deadline(now,timeout_ms);
+  struct timeval deadline,now,start;
+  gettimeofday(&start,NULL);
+  deadline = compute_deadline(start,timeout_ms);
 
   struct sockaddr_in s;
   while (true)
@@ -125,17 +259,23 @@ locate_servers(int numServers, long timeout_ms)
       return NormalReturn;
     }
     
-    if (time_diff_ms(deadline,now) < 1) {
-      return ErrorReturn;
-    }
-    
-    if (netRecv(buf, BUFFER_SIZE, &s, deadline) > 0) {
-      msg = (struct replfs_msg *) buf;
-      if (msg->msg_type == MsgDiscoverAck) 
-        if (!known_server(&s))
-          CVectorAppend(servers,&s);
+    msg = netRingNext(inbox, NULL, &s);
+    if (!msg) {
+      if (time_diff_ms(deadline,now) < 1)
+        return ErrorReturn;
+      netRecvBatch(inbox, deadline);
+      continue;
     }
 
+    if (msg->msg_type == MsgDiscoverAck) 
+      if (!known_server(&s)) {
+        struct server server;
+        server.addr = s;
+        rtt_init(&server.rtt);
+        rtt_sample(&server.rtt,time_diff_us(now,start));
+        CVectorAppend(servers,&server);
+      }
+
   } 
 
   //execution thread shouldn't get here
@@ -193,82 +333,536 @@ enum MsgHandlerResponse close_handler(struct replfs_msg *msg, void *aux)
 
 }
 
-enum MsgHandlerResponse try_commit_handler(struct replfs_msg *msg, void *aux)
+/* 
+ * Missing wids of the transaction being committed, bit i is from_wid+i,
+ * and the missing fragments of blocks servers hold only part of.
+ */
+struct wid_set {
+  int from_wid;
+  int n;
+  uint64_t *bits;
+  CVector *frags;
+};
+
+struct wid_set *
+wid_set_create(int from_wid, int to_wid)
 {
-  struct replfs_msg_commit_long *payload = 
-                (struct replfs_msg_commit_long *)get_payload(msg);
-  int *dataload = (int *) (((char *)payload) + 
-                            sizeof(struct replfs_msg_commit_long));
-  CVector *missing = (CVector *)aux;
-  
-  //what about checking fd? and range?
-  //if (payload->fd != )
-  //  return NeutralResponse;
+  struct wid_set *set = malloc(sizeof(struct wid_set));
+  assert(set);
+  set->from_wid = from_wid;
+  set->n = to_wid - from_wid + 1;
+  set->bits = calloc(set->n / 64 + 1, sizeof(uint64_t));
+  assert(set->bits);
+  set->frags = CVectorCreate(sizeof(struct frag_range),0,NULL);
+  return set;
+}
 
-  if (msg->msg_type == MsgTryCommitSuccess)
-    return SuccessReponse;
+void
+wid_set_dispose(struct wid_set *set)
+{
+  CVectorDispose(set->frags);
+  free(set->bits);
+  free(set);
+}
 
-  if (msg->msg_type == MsgTryCommitFail) {
-    for (int i=0; i< payload->n; i++)
-      if (CVectorSearch(missing,&dataload[i],intcmp,0,false) == -1)
-        CVectorAppend(missing,&dataload[i]);
-    return FatalResponse;
+/* merges one reported run, duplicates across servers collapse */
+void
+wid_set_add_range(int from_wid, int to_wid, void *aux)
+{
+  struct wid_set *set = (struct wid_set *)aux;
+  if (from_wid < set->from_wid)
+    from_wid = set->from_wid;
+  if (to_wid >= set->from_wid + set->n)
+    to_wid = set->from_wid + set->n - 1;
+  for (int bit = from_wid - set->from_wid; 
+       bit <= to_wid - set->from_wid; bit++)
+    set->bits[bit >> 6] |= 1ULL << (bit & 63);
+}
+
+void
+wid_set_add_frags(struct frag_range *range, void *aux)
+{
+  struct wid_set *set = (struct wid_set *)aux;
+  CVectorAppend(set->frags,range);
+}
+
+bool
+wid_set_has(struct wid_set *set, int wid)
+{
+  int bit = wid - set->from_wid;
+  if (bit < 0 || bit >= set->n)
+    return false;
+  return (set->bits[bit >> 6] >> (bit & 63)) & 1;
+}
+
+int
+fragcmp(const void *a, const void *b)
+{
+  struct frag_range *fa = (struct frag_range *)a;
+  struct frag_range *fb = (struct frag_range *)b;
+  if (fa->wid != fb->wid)
+    return fa->wid > fb->wid ? 1 : -1;
+  if (fa->from_frag != fb->from_frag)
+    return fa->from_frag > fb->from_frag ? 1 : -1;
+  return 0;
+}
+
+struct staged_write *
+logged_write(struct write_log *wlog, int wid)
+{
+  CVector *writes = wlog->writes;
+  if (CVectorCount(writes) == 0)
+    return NULL;
+  /* the log holds consecutive wids, in order */
+  int index = wid - ((struct write_block *) CVectorNth(writes,0))->wid;
+  if (index < 0 || index >= CVectorCount(writes))
+    return NULL;
+  return (struct staged_write *) CVectorNth(writes,index);
+}
+
+/* the write has gone out, its bytes live on in the extent map */
+void
+drop_data(struct write_log *wlog, int wid)
+{
+  struct staged_write *sw = logged_write(wlog,wid);
+  if (sw) {
+    free(sw->wb.data);
+    sw->wb.data = NULL;
   }
-  
-  return NeutralResponse;
+}
 
+void
+free_scratch(void *p)
+{
+  free(*(char **) p);
 }
 
-enum MsgHandlerResponse commit_handler(struct replfs_msg *msg, void *aux)
+/* sends the coalesced writes, which need their own data no longer */
+void
+flush_pending(struct open_file *f)
 {
-  // struct replfs_msg_commit *payload = 
-  //               (struct replfs_msg_commit *)get_payload(msg);
-  //what about checking fd? and range?
-  //if (payload->fd != )
-  //  return NeutralResponse;
+  int n = f->pending.n;
+  send_write_batch(&f->pending);
+  for (int i=0; i<n; i++)
+    drop_data(f->wlog,f->pending.hdrs[i].wid);
+}
 
-  if (msg->msg_type == MsgCommitSuccess)
-    return SuccessReponse;
+/* the block to resend, cut from the extent map if its data is gone */
+struct write_block
+resend_block(struct write_log *wlog, struct staged_write *sw, 
+             CVector *scratch)
+{
+  struct write_block wb = sw->wb;
+  if (!wb.data) {
+    wb.data = malloc(wb.len > 0 ? wb.len : 1);
+    assert(wb.data);
+    bool covered = ExtMapRead(wlog->bytes,wb.offset,wb.len,wb.data);
+    assert(covered);
+    CVectorAppend(scratch,&wb.data);
+  }
+  return wb;
+}
 
-  if (msg->msg_type == MsgCommitFail)
-    return FatalResponse;
-  
-  return NeutralResponse;
+bool
+recently_resent(struct staged_write *sw, struct timeval now)
+{
+  return time_diff_ms(now,sw->resent) < REPAIR_WINDOW_MS;
+}
+
+/* resends the missing fragments not covered by a whole-block resend */
+int retransmit_frags(struct write_log *wlog, struct wid_set *missing, 
+                     struct timeval now, CVector *scratch)
+{
+  int n = 0;
+  int last_wid = 0, sent_to = -1;
+  CVectorSort(missing->frags,fragcmp);
+  for (struct frag_range *fr = CVectorFirst(missing->frags); fr != NULL;
+       fr = CVectorNext(missing->frags,fr)) {
+    struct staged_write *sw = logged_write(wlog,fr->wid);
+    if (!sw || wid_set_has(missing,fr->wid) || recently_resent(sw,now))
+      continue;
+    struct write_block block = resend_block(wlog,sw,scratch);
+    struct write_block *wb = &block;
+    if (fr->wid != last_wid)
+      sent_to = -1;
+    last_wid = fr->wid;
+    /* reports from several servers overlap */
+    for (int frag = fr->from_frag > sent_to ? fr->from_frag : sent_to + 1;
+         frag <= fr->to_frag && frag < frag_count(wb->len); frag++) {
+      send_write_frag(wb,frag);
+      n++;
+    }
+    if (fr->to_frag > sent_to)
+      sent_to = fr->to_frag;
+  }
+  CVectorDispose(missing->frags);
+  missing->frags = CVectorCreate(sizeof(struct frag_range),0,NULL);
+  return n;
+}
+
+/* 
+ * Resends every wid in the set from the log and empties the set. Blocks
+ * resent within REPAIR_WINDOW_MS are skipped, so NACKs for one loss from
+ * several servers cost a single repair.
+ */
+void retransmit(struct write_log *wlog, struct wid_set *missing)
+{
+  int n = 0, nskipped = 0;
+  struct timeval now;
+  gettimeofday(&now,NULL);
+  struct write_batch batch;
+  batch_init(&batch);
+  CVector *scratch = CVectorCreate(sizeof(char *),0,free_scratch);
+  netCork();
+  int nfrags = retransmit_frags(wlog,missing,now,scratch);
+  for (int w=0; w<=missing->n / 64; w++) {
+    uint64_t word = missing->bits[w];
+    missing->bits[w] = 0;
+    while (word) {
+      int wid = missing->from_wid + w*64 + __builtin_ctzll(word);
+      word &= word - 1;
+      struct staged_write *sw = logged_write(wlog,wid);
+      if (!sw)
+        continue;
+      if (recently_resent(sw,now)) {
+        nskipped++;
+        continue;
+      }
+      sw->resent = now;
+      struct write_block block = resend_block(wlog,sw,scratch);
+      struct write_block *wb = &block;
+      printf("retrying wid: %d\n", wid);
+      if (!batch_add(&batch,wb)) {
+        send_write_batch(&batch);
+        if (!batch_add(&batch,wb))
+          send_write(wb);
+      }
+      n++;
+    }
+  }
+  send_write_batch(&batch);
+  netUncork();
+  CVectorDispose(scratch);
+  printf("retransmitted %d writes, %d fragments, %d just resent.\n",
+         n,nfrags,nskipped);
+}
 
+/* resends what a server's streaming NACK reports missing from the log */
+void
+repair(struct write_log *wlog, struct replfs_msg *msg)
+{
+  CVector *writes = wlog->writes;
+  if (CVectorCount(writes) == 0)
+    return;
+  struct write_block *first = (struct write_block *) CVectorFirst(writes);
+  int last_wid = first->wid + CVectorCount(writes) - 1;
+  struct wid_set *missing = wid_set_create(first->wid, last_wid);
+  nack_ranges(msg,wid_set_add_range,missing);
+  nack_frags(msg,wid_set_add_frags,missing);
+  retransmit(wlog,missing);
+  wid_set_dispose(missing);
 }
 
-int 
-collect_responses(CVector *responders, MsgHandlerFn fn, 
-                  void *aux,long timeout_ms)
+struct open_file *
+find_file(int fd)
+{
+  for (int i=0; i<CVectorCount(files); i++) {
+    struct open_file *f = *(struct open_file **) CVectorNth(files,i);
+    if (f->fd == fd)
+      return f;
+  }
+  return NULL;
+}
+
+/* 
+ * The file, locked, or NULL if fd is not open or is being closed. While 
+ * waiting for the lock a thread is counted, so the file is not freed 
+ * under it, and it lets go once it finds the file closing.
+ */
+struct open_file *
+lock_file(int fd)
+{
+  pthread_mutex_lock(&state_lock);
+  struct open_file *f = find_file(fd);
+  if (f && f->closing)
+    f = NULL;
+  if (f)
+    f->waiters++;
+  pthread_mutex_unlock(&state_lock);
+  if (!f)
+    return NULL;
+
+  pthread_mutex_lock(&f->lock);
+  pthread_mutex_lock(&state_lock);
+  bool closing = f->closing;
+  if (!closing)
+    f->waiters--;
+  pthread_mutex_unlock(&state_lock);
+  if (!closing)
+    return f;
+
+  pthread_mutex_unlock(&f->lock);
+  pthread_mutex_lock(&state_lock);
+  if (--f->waiters == 0)
+    pthread_cond_signal(&f->unused);
+  pthread_mutex_unlock(&state_lock);
+  return NULL;
+}
+
+/* no thread locks the file from now on, called with its lock held */
+void
+mark_closing(struct open_file *f)
+{
+  pthread_mutex_lock(&state_lock);
+  f->closing = true;
+  pthread_mutex_unlock(&state_lock);
+}
+
+/* 
+ * The commit in flight a reply is about: commit replies name its range,
+ * NACKs start within it. Called with state_lock held.
+ */
+struct commit_op *
+find_op(struct replfs_msg *msg)
+{
+  struct replfs_msg_commit *payload = 
+                (struct replfs_msg_commit *) get_payload(msg);
+  for (int i=0; i<CVectorCount(ops); i++) {
+    struct commit_op *op = *(struct commit_op **) CVectorNth(ops,i);
+    if (!op->started || op->fd != payload->fd)
+      continue;
+    if (msg->msg_type == MsgNack ? 
+        op->first_wid <= payload->from_wid && payload->from_wid <= op->last_wid :
+        op->first_wid == payload->from_wid && op->last_wid == payload->to_wid)
+      return op;
+  }
+  return NULL;
+}
+
+void
+wake_box(struct mailbox *box)
+{
+  pthread_cond_signal(&box->ready);
+}
+
+/* 
+ * Moves what the last receive brought in to the mailboxes of the files 
+ * or commits the replies are about, and lets a waiting thread take over 
+ * receiving. Anything but a server's reply is dropped. Called with 
+ * state_lock held.
+ */
+void
+route_mail()
 {
-  char buf[BUFFER_SIZE];
   struct replfs_msg *msg;
-  struct timeval deadline,now;
-  gettimeofday(&now,NULL);
-  deadline = compute_deadline(now,timeout_ms);
+  size_t len;
+  struct mail m;
+  while ((msg = netRingNext(inbox, &len, &m.sender)) != NULL) {
+    switch (msg->msg_type) {
+      case MsgOpenSuccess: case MsgOpenFail:
+      case MsgCloseSuccess: case MsgCloseFail:
+      case MsgTryCommitSuccess: case MsgTryCommitFail:
+      case MsgCommitSuccess: case MsgCommitFail:
+      case MsgNack:
+        break;
+      default:
+        continue;
+    }
+    struct mailbox *box = &commit_box;
+    if (!find_op(msg)) {
+      /* every reply starts with the fd */
+      struct open_file *f = find_file(*(int *) get_payload(msg));
+      if (!f)
+        continue;
+      box = &f->box;
+    }
+    memcpy(m.buf,msg,len);
+    CVectorAppend(box->mail,&m);
+  }
+  reading = false;
+  for (int i=0; i<CVectorCount(files); i++)
+    wake_box(&(*(struct open_file **) CVectorNth(files,i))->box);
+  wake_box(&commit_box);
+}
 
-  struct sockaddr_in s;
+/* 
+ * The next reply in the box, waiting for it until deadline or a kick. If 
+ * no other thread is receiving, this one does, for everyone. 
+ */
+bool
+next_mail(struct mailbox *box, struct mail *m, struct timeval deadline)
+{
+  pthread_mutex_lock(&state_lock);
   while (true) {
-    printf("%d servers reponded.\n",CVectorCount(responders));
+    if (CVectorCount(box->mail) > 0) {
+      memcpy(m,CVectorFirst(box->mail),sizeof(struct mail));
+      CVectorRemove(box->mail,0);
+      pthread_mutex_unlock(&state_lock);
+      return true;
+    }
+    struct timeval now;
     gettimeofday(&now,NULL);
+    if (time_diff_us(deadline,now) <= 0 || box->kicked) {
+      box->kicked = false;
+      pthread_mutex_unlock(&state_lock);
+      return false;
+    }
+    if (!reading) {
+      reading = true;
+      pthread_mutex_unlock(&state_lock);
+      /* sleep until the socket is readable or the timer fires */
+      netTimerArm(deadline_timer,deadline);
+      if (netRecvReady(inbox) == 0) {
+        netLoopOnce(loop);
+        netRecvReady(inbox);
+      }
+      pthread_mutex_lock(&state_lock);
+      route_mail();
+      continue;
+    }
+    struct timespec until = { deadline.tv_sec, 
+                              deadline.tv_usec * NANOSEC_IN_MICROSEC };
+    pthread_cond_timedwait(&box->ready,&state_lock,&until);
+  }
+}
+
+/* takes in the NACKs that arrived while streaming, without blocking */
+void
+poll_nacks(struct open_file *f)
+{
+  pthread_mutex_lock(&state_lock);
+  if (!reading) {
+    reading = true;
+    pthread_mutex_unlock(&state_lock);
+    netRecvReady(inbox);
+    pthread_mutex_lock(&state_lock);
+    route_mail();
+  }
+  pthread_mutex_unlock(&state_lock);
+
+  /* anything else still in the mailbox is stale */
+  struct mail m;
+  struct timeval now = { 0, 0 };
+  while (next_mail(&f->box,&m,now))
+    if (((struct replfs_msg *) m.buf)->msg_type == MsgNack)
+      repair(f->wlog,(struct replfs_msg *) m.buf);
+}
+
+/* 
+ * Sends the coalesced writes of files no WriteBlock() came back to within 
+ * WRITE_COALESCE_MS, and returns when to look again. A file locked by 
+ * another thread is looked at again once that much has passed.
+ */
+struct timeval
+flush_stale_writes(struct timeval now, struct timeval deadline)
+{
+  struct timeval soon = compute_deadline(now,WRITE_COALESCE_MS);
+  pthread_mutex_lock(&state_lock);
+  for (int i=0; i<CVectorCount(files); i++) {
+    struct open_file *f = *(struct open_file **) CVectorNth(files,i);
+    if (f->closing)
+      continue;
+    if (pthread_mutex_trylock(&f->lock) != 0) {
+      if (time_diff_us(deadline,soon) > 0)
+        deadline = soon;
+      continue;
+    }
+    if (f->pending.n > 0) {
+      struct timeval due = compute_deadline(f->pending_since,WRITE_COALESCE_MS);
+      if (time_diff_us(due,now) <= 0) {
+        netSetGroup(f->group);
+        flush_pending(f);
+      } else if (time_diff_us(deadline,due) > 0) {
+        deadline = due;
+      }
+    }
+    pthread_mutex_unlock(&f->lock);
+  }
+  pthread_mutex_unlock(&state_lock);
+  return deadline;
+}
+
+/* the longest retransmit timeout among servers yet to respond */
+long
+retransmit_timeout(CVector *responders)
+{
+  long timeout_ms = RTO_MIN_MS;
+  pthread_mutex_lock(&state_lock);
+  for (int i=0; i<CVectorCount(servers); i++) {
+    struct server *sv = (struct server *) CVectorNth(servers,i);
+    if (new_responder(responders,&sv->addr) && 
+        rtt_timeout(&sv->rtt) > timeout_ms)
+      timeout_ms = rtt_timeout(&sv->rtt);
+  }
+  pthread_mutex_unlock(&state_lock);
+  return timeout_ms;
+}
+
+void
+wake_up(void *aux)
+{
+}
+
+void
+drain_kick(void *aux)
+{
+  uint64_t n;
+  if (read(kick_fd,&n,sizeof(n)) < 0 && errno != EAGAIN)
+    perror("eventfd");
+}
+
+/* 
+ * Waits out one retransmit timeout for replies about the file. Only 
+ * replies to a request that was sent once are timed (Karn), servers that
+ * stay silent back off.
+ */
+int 
+collect_responses(struct open_file *f, CVector *responders, MsgHandlerFn fn, 
+                  void *aux, bool first_try)
+{
+  struct timeval deadline,now,start;
+  gettimeofday(&start,NULL);
+  deadline = compute_deadline(start,retransmit_timeout(responders));
+
+  struct mail m;
+  struct replfs_msg *msg = (struct replfs_msg *) m.buf;
+  while (true) {
+    printf("%d servers reponded.\n",CVectorCount(responders));
     if (CVectorCount(responders) >= CVectorCount(servers))
       return NormalReturn; 
 
-    if (time_diff_ms(deadline,now) < 1)
+    if (!next_mail(&f->box,&m,deadline)) {
+      pthread_mutex_lock(&state_lock);
+      for (int i=0; i<CVectorCount(servers); i++) {
+        struct server *sv = (struct server *) CVectorNth(servers,i);
+        if (new_responder(responders,&sv->addr))
+          rtt_backoff(&sv->rtt);
+      }
+      pthread_mutex_unlock(&state_lock);
       return ErrorReturn;
-    
-    if (netRecv(buf, BUFFER_SIZE, &s, deadline) > 0) {
-      msg = (struct replfs_msg *) buf;
-      enum MsgHandlerResponse mhr = fn(msg,aux);
-      if (mhr == SuccessReponse) {
-          printf("recieved successful response\n");
-          if (known_server(&s) && new_responder(responders,&s)) {
-              printf("new response from known server\n");
-              CVectorAppend(responders, &s);
-        } else if (mhr == FatalResponse) {
-          printf("received failure repsonse\n");
-          return ErrorReturn;
-        }
+    }
+    gettimeofday(&now,NULL);
+
+    if (msg->msg_type == MsgNack) {
+      repair(f->wlog,msg);
+      continue;
+    }
+
+    enum MsgHandlerResponse mhr = fn(msg,aux);
+    if (mhr == SuccessReponse) {
+        printf("recieved successful response\n");
+        int index = CVectorSearch(servers,&m.sender,sockcmp,0,false);
+        if (index != -1 && new_responder(responders,&m.sender)) {
+            printf("new response from known server\n");
+            CVectorAppend(responders, &m.sender);
+            struct server *sv = (struct server *) CVectorNth(servers,index);
+            pthread_mutex_lock(&state_lock);
+            if (first_try)
+              rtt_sample(&sv->rtt,time_diff_us(now,start));
+            pthread_mutex_unlock(&state_lock);
+      } else if (mhr == FatalResponse) {
+        printf("received failure repsonse\n");
+        return ErrorReturn;
       }
     }
   }
@@ -276,19 +870,354 @@ collect_responses(CVector *responders, MsgHandlerFn fn,
   return ErrorReturn;
 }
 
-void retransmit(CVector *missing)
+int
+join_group(uint32_t group)
+{
+  pthread_mutex_lock(&state_lock);
+  int *users = &group_users[group - FILE_GROUP_BASE];
+  int result = *users == 0 ? netJoin(group) : 0;
+  if (result == 0)
+    (*users)++;
+  pthread_mutex_unlock(&state_lock);
+  return result;
+}
+
+void
+leave_group(uint32_t group)
+{
+  pthread_mutex_lock(&state_lock);
+  if (--group_users[group - FILE_GROUP_BASE] == 0)
+    netLeave(group);
+  pthread_mutex_unlock(&state_lock);
+}
+
+struct open_file *
+add_file(int fd, char *fileName)
+{
+  struct open_file *f = calloc(1,sizeof(struct open_file));
+  assert(f);
+  f->fd = fd;
+  f->group = file_group(fileName);
+  f->widcount = 1;
+  reset_log(f);
+  pthread_mutex_init(&f->lock,NULL);
+  pthread_cond_init(&f->unused,NULL);
+  pthread_cond_init(&f->box.ready,NULL);
+  f->box.mail = CVectorCreate(sizeof(struct mail),0,NULL);
+  pthread_mutex_lock(&state_lock);
+  CVectorAppend(files,&f);
+  pthread_mutex_unlock(&state_lock);
+  return f;
+}
+
+/* once marked closing and unlocked, frees it after any waiters let go */
+void
+remove_file(struct open_file *f)
+{
+  pthread_mutex_lock(&state_lock);
+  for (int i=0; i<CVectorCount(files); i++)
+    if (*(struct open_file **) CVectorNth(files,i) == f)
+      CVectorRemove(files,i);
+  while (f->waiters > 0)
+    pthread_cond_wait(&f->unused,&state_lock);
+  pthread_mutex_unlock(&state_lock);
+  dispose_log(f->wlog);
+  CVectorDispose(f->box.mail);
+  pthread_mutex_destroy(&f->lock);
+  pthread_cond_destroy(&f->unused);
+  pthread_cond_destroy(&f->box.ready);
+  free(f);
+}
+
+void
+kick(struct mailbox *box)
+{
+  pthread_mutex_lock(&state_lock);
+  box->kicked = true;
+  wake_box(box);
+  pthread_mutex_unlock(&state_lock);
+  uint64_t one = 1;
+  if (write(kick_fd,&one,sizeof(one)) < 0)
+    perror("eventfd");
+}
+
+/* sends the current phase's request, once more */
+void
+send_phase(struct commit_op *op)
+{
+  netSetGroup(op->group);
+  if (op->committing)
+    send_commit(op->fd,op->first_wid,op->last_wid);
+  else
+    send_try_commit(op->fd,op->first_wid,op->last_wid);
+  gettimeofday(&op->sent,NULL);
+  op->deadline = compute_deadline(op->sent,retransmit_timeout(op->responders));
+  op->tries++;
+}
+
+void
+finish_op(struct commit_op *op, int result)
+{
+  if (result != NormalReturn)
+    fprintf(stderr,"%s phase of commit failed\n",
+            op->committing ? "second" : "first");
+  else
+    printf("commit successful\n");
+  op->done = true;
+  op->result = result;
+}
+
+void
+start_op(struct commit_op *op)
 {
-  printf("retransmitting %d writes.\n",CVectorCount(missing));
-  CVectorRemoveDuplicate(missing, intcmp);
-  for (int i=0; i<CVectorCount(missing); i++) {
-    struct write_block wb;
-    wb.wid = *(int *)CVectorNth(missing,i);
-    printf("retrying wid: %d\n", wb.wid);
-    int index;
-    if((index = CVectorSearch(wlog,&wb,(CVectorCmpElemFn) wbcmp,0,true)) > 0) {
-      send_write((struct write_block *) CVectorNth(wlog,index));
+  op->started = true;
+  if (op->first_wid > op->last_wid) {
+    /* nothing staged, nothing to commit */
+    finish_op(op,NormalReturn);
+    return;
+  }
+  op->responders = CVectorCreate(sizeof(struct sockaddr_in),
+                                 CVectorCount(servers),NULL);
+  op->missing = wid_set_create(op->first_wid,op->last_wid);
+  send_phase(op);
+}
+
+/* the phase ran out of time, or a server turned it down */
+void
+retry_op(struct commit_op *op)
+{
+  if (op->tries >= (op->committing ? RETRY_COMMIT : RETRY_TRY_COMMIT)) {
+    finish_op(op,ErrorReturn);
+    return;
+  }
+  /* the last op to send from this thread may have been another file's */
+  netSetGroup(op->group);
+  if (!op->committing)
+    retransmit(op->wlog,op->missing);
+  op->refused = false;
+  send_phase(op);
+}
+
+void
+time_out_op(struct commit_op *op)
+{
+  pthread_mutex_lock(&state_lock);
+  for (int i=0; i<CVectorCount(servers); i++) {
+    struct server *sv = (struct server *) CVectorNth(servers,i);
+    if (new_responder(op->responders,&sv->addr))
+      rtt_backoff(&sv->rtt);
+  }
+  pthread_mutex_unlock(&state_lock);
+  retry_op(op);
+}
+
+void
+handle_reply(struct commit_op *op, struct mail *m)
+{
+  struct replfs_msg *msg = (struct replfs_msg *) m->buf;
+  netSetGroup(op->group);
+  if (msg->msg_type == MsgNack) {
+    repair(op->wlog,msg);
+    return;
+  }
+
+  int success = op->committing ? MsgCommitSuccess : MsgTryCommitSuccess;
+  int fail = op->committing ? MsgCommitFail : MsgTryCommitFail;
+  if (msg->msg_type == fail) {
+    /* 
+     * repairs go out now, the request again no sooner than a repair 
+     * could, or refusals of repairs still in transit use up the retries
+     */
+    if (!op->committing) {
+      nack_ranges(msg,wid_set_add_range,op->missing);
+      nack_frags(msg,wid_set_add_frags,op->missing);
+      retransmit(op->wlog,op->missing);
     }
+    struct timeval due = compute_deadline(op->sent,REPAIR_WINDOW_MS);
+    if (time_diff_us(op->deadline,due) > 0)
+      op->deadline = due;
+    op->refused = true;
+    return;
+  }
+  if (msg->msg_type != success)
+    return;
+
+  int index = CVectorSearch(servers,&m->sender,sockcmp,0,false);
+  if (index == -1 || !new_responder(op->responders,&m->sender))
+    return;
+  CVectorAppend(op->responders,&m->sender);
+  if (op->tries == 1) {
+    struct timeval now;
+    gettimeofday(&now,NULL);
+    struct server *sv = (struct server *) CVectorNth(servers,index);
+    pthread_mutex_lock(&state_lock);
+    rtt_sample(&sv->rtt,time_diff_us(now,op->sent));
+    pthread_mutex_unlock(&state_lock);
+  }
+  if (CVectorCount(op->responders) < CVectorCount(servers))
+    return;
+
+  if (op->committing) {
+    finish_op(op,NormalReturn);
+    return;
   }
+  op->committing = true;
+  op->tries = 0;
+  CVectorDispose(op->responders);
+  op->responders = CVectorCreate(sizeof(struct sockaddr_in),
+                                 CVectorCount(servers),NULL);
+  send_phase(op);
+}
+
+void
+dispose_op(struct commit_op *op)
+{
+  dispose_log(op->wlog);
+  if (op->responders)
+    CVectorDispose(op->responders);
+  if (op->missing)
+    wid_set_dispose(op->missing);
+  free(op);
+}
+
+/* 
+ * The commit thread. It starts each queued commit once those before it 
+ * on the same fd are done, drives both phases off the replies routed to
+ * it and its deadlines, and runs the callbacks.
+ */
+void *
+commit_main(void *aux)
+{
+  while (true) {
+    struct timeval now, deadline;
+    gettimeofday(&now,NULL);
+    deadline = compute_deadline(now,MILLISEC_IN_SEC);
+
+    pthread_mutex_lock(&state_lock);
+    int nops = CVectorCount(ops);
+    if (stopping && nops == 0) {
+      pthread_mutex_unlock(&state_lock);
+      break;
+    }
+    struct commit_op *pending[nops > 0 ? nops : 1];
+    if (nops > 0)
+      memcpy(pending,CVectorFirst(ops),nops * sizeof(struct commit_op *));
+    pthread_mutex_unlock(&state_lock);
+
+    for (int i=0; i<nops; i++) {
+      struct commit_op *op = pending[i];
+      bool first_on_fd = true;
+      for (int j=0; j<i; j++)
+        first_on_fd &= pending[j]->fd != op->fd;
+      if (!op->started && first_on_fd)
+        start_op(op);
+      else if (op->started && !op->done && 
+               time_diff_us(op->deadline,now) <= 0) {
+        if (op->refused)
+          retry_op(op);
+        else
+          time_out_op(op);
+      }
+      if (op->started && !op->done && time_diff_us(deadline,op->deadline) > 0)
+        deadline = op->deadline;
+    }
+
+    /* done ones leave the queue before their callbacks run */
+    bool finished = false;
+    pthread_mutex_lock(&state_lock);
+    for (int i=CVectorCount(ops)-1; i>=0; i--)
+      if ((*(struct commit_op **) CVectorNth(ops,i))->done)
+        CVectorRemove(ops,i);
+    pthread_mutex_unlock(&state_lock);
+    for (int i=0; i<nops; i++) {
+      struct commit_op *op = pending[i];
+      if (!op->done)
+        continue;
+      finished = true;
+      op->cb(op->fd,op->result,op->ctx);
+      dispose_op(op);
+    }
+    /* the next commits on those fds can start */
+    if (finished)
+      continue;
+
+    deadline = flush_stale_writes(now,deadline);
+
+    struct mail m;
+    if (next_mail(&commit_box,&m,deadline)) {
+      pthread_mutex_lock(&state_lock);
+      struct commit_op *op = find_op((struct replfs_msg *) m.buf);
+      pthread_mutex_unlock(&state_lock);
+      if (op && !op->done)
+        handle_reply(op,&m);
+    }
+  }
+  return NULL;
+}
+
+/* 
+ * Hands the file's staged writes to the commit thread as one 
+ * transaction, the file starts staging the next. Holds the file's lock.
+ */
+void
+queue_commit(struct open_file *f, ReplFsCommitFn cb, void *ctx)
+{
+  netSetGroup(f->group);
+  flush_pending(f);
+  send_write_parity(&f->parity);
+
+  struct commit_op *op = calloc(1,sizeof(struct commit_op));
+  assert(op);
+  op->fd = f->fd;
+  op->group = f->group;
+  op->wlog = f->wlog;
+  CVector *writes = f->wlog->writes;
+  op->first_wid = CVectorCount(writes) ? 
+                  ((struct write_block *) CVectorFirst(writes))->wid : 0;
+  op->last_wid = op->first_wid + CVectorCount(writes) - 1;
+  op->cb = cb;
+  op->ctx = ctx;
+  f->wlog = NULL;
+  reset_log(f);
+
+  pthread_mutex_lock(&state_lock);
+  CVectorAppend(ops,&op);
+  pthread_mutex_unlock(&state_lock);
+  kick(&commit_box);
+}
+
+/* what a blocking call waits on */
+struct waiter {
+  bool done;
+  int result;
+  pthread_cond_t cond;
+};
+
+void
+wake_waiter(int fd, int result, void *ctx)
+{
+  struct waiter *w = (struct waiter *) ctx;
+  pthread_mutex_lock(&state_lock);
+  w->done = true;
+  w->result = result;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&state_lock);
+}
+
+/* commits what the file has staged, after every commit queued before it */
+int
+commit_wait(struct open_file *f)
+{
+  struct waiter w;
+  w.done = false;
+  pthread_cond_init(&w.cond,NULL);
+  queue_commit(f,wake_waiter,&w);
+  pthread_mutex_lock(&state_lock);
+  while (!w.done)
+    pthread_cond_wait(&w.cond,&state_lock);
+  pthread_mutex_unlock(&state_lock);
+  pthread_cond_destroy(&w.cond);
+  return w.result;
 }
 
 int
@@ -303,8 +1232,19 @@ InitReplFs( unsigned short portNum, int packetLoss, int numServers ) {
   /****************************************************/
   if (netInit(portNum,packetLoss))
     ERROR("connection failed");
-
-  servers = CVectorCreate(sizeof(struct sockaddr_in), numServers,NULL);
+  inbox = netRingCreate(RECV_BATCH);
+  loop = netLoopCreate();
+  kick_fd = eventfd(0,EFD_NONBLOCK);
+  if (kick_fd < 0 || netLoopAdd(loop,netSocket(),wake_up,NULL) < 0 ||
+      netLoopAdd(loop,kick_fd,drain_kick,NULL) < 0 ||
+      (deadline_timer = netTimerCreate(loop,wake_up,NULL)) < 0)
+    ERROR("unable to set up the event loop");
+
+  servers = CVectorCreate(sizeof(struct server), numServers,NULL);
+  files = CVectorCreate(sizeof(struct open_file *),0,NULL);
+  ops = CVectorCreate(sizeof(struct commit_op *),0,NULL);
+  commit_box.mail = CVectorCreate(sizeof(struct mail),0,NULL);
+  pthread_cond_init(&commit_box.ready,NULL);
   int success = ErrorReturn;
   for (int i=0; i<RETRY_CONNECT; i++)
     if ((success = locate_servers(numServers,TIMEOUT_CONNECT)) == NormalReturn)
@@ -316,7 +1256,10 @@ InitReplFs( unsigned short portNum, int packetLoss, int numServers ) {
   printf("connection established.\n");
   print_servers();
 
-  reset_log();
+  stopping = false;
+  if (pthread_create(&committer,NULL,commit_main,NULL))
+    ERROR("unable to start the commit thread");
+  committer_running = true;
 
   return( NormalReturn );  
 }
@@ -345,21 +1288,33 @@ OpenFile( char * fileName ) {
   if ( fd < 0 )
     ERROR("unable to open the file locally");
 
+  /* registered first, so the replies find it */
+  struct open_file *f = add_file(fd,fileName);
+  pthread_mutex_lock(&f->lock);
+  netSetGroup(0);
+
   CVector *responders = CVectorCreate(sizeof(struct sockaddr_in), 
                                       CVectorCount(servers),NULL);
   int success = ErrorReturn;
   for (int i=0; i<RETRY_OPEN; i++) {
     send_open(fileName, fd);
-    if ((success = collect_responses(responders,open_handler,
-                        (void *)&fd, TIMEOUT_OPEN)) == NormalReturn)
+    if ((success = collect_responses(f,responders,open_handler,
+                        (void *)&fd, i == 0)) == NormalReturn)
       break;
   }
 
   CVectorDispose(responders);
+  /* servers joined the file's group before they answered */
+  if (success == NormalReturn && join_group(f->group))
+    success = ErrorReturn;
   if (success != NormalReturn)
+    mark_closing(f);
+  pthread_mutex_unlock(&f->lock);
+  if (success != NormalReturn) {
+    remove_file(f);
+    close(fd);
     ERROR("unable to open file remotely");
-
-  wlog = CVectorCreate(sizeof(struct write_block),0,wbfree);
+  }
 
   printf("file opened successfully\n");
 
@@ -387,7 +1342,20 @@ WriteBlock( int fd, char * buffer, int byteOffset, int blockSize ) {
   ASSERT( fd >= 0 );
   ASSERT( byteOffset >= 0 );
   ASSERT( buffer );
-  ASSERT( blockSize >= 0 && blockSize < MaxBlockLength );
+  ASSERT( blockSize >= 0 && blockSize <= MAX_WRITE_LEN );
+
+  if ( blockSize < 0 || blockSize > MAX_WRITE_LEN )
+    return(ErrorReturn);
+
+  struct open_file *f = lock_file(fd);
+  if (!f)
+    return(ErrorReturn);
+  /* the servers would refuse the rest of the transaction */
+  if (CVectorCount(f->wlog->writes) >= MAX_STAGED_WRITES) {
+    pthread_mutex_unlock(&f->lock);
+    return(ErrorReturn);
+  }
+  netSetGroup(f->group);
 
 #ifdef DEBUG
   printf( "WriteBlock: Writing FD=%d, Offset=%d, Length=%d\n",
@@ -396,15 +1364,24 @@ WriteBlock( int fd, char * buffer, int byteOffset, int blockSize ) {
 
   if ( lseek( fd, byteOffset, SEEK_SET ) < 0 ) {
     perror( "WriteBlock Seek" );
+    pthread_mutex_unlock(&f->lock);
     return(ErrorReturn);
   }
 
   if ( ( bytesWritten = write( fd, buffer, blockSize ) ) < 0 ) {
     perror( "WriteBlock write" );
+    pthread_mutex_unlock(&f->lock);
     return(ErrorReturn);
   }
 
-  int wid = next_wid(fd);  
+  /* a new FEC setting starts with a fresh group */
+  if (f->fec_k != fec_k) {
+    flush_pending(f);
+    send_write_parity(&f->parity);
+    f->fec_k = fec_k;
+  }
+
+  int wid = next_wid(f);  
   struct write_block wb;
   wb.fd = fd;
   wb.wid = wid;
@@ -412,11 +1389,47 @@ WriteBlock( int fd, char * buffer, int byteOffset, int blockSize ) {
   memcpy(wb.data,buffer,blockSize);
   wb.offset = byteOffset;
   wb.len = blockSize;
-  CVectorAppend(wlog,&wb);
-
-  send_write(&wb);
+  struct staged_write sw;
+  sw.wb = wb;
+  sw.resent.tv_sec = 0;
+  sw.resent.tv_usec = 0;
+  CVectorAppend(f->wlog->writes,&sw);
+  ExtMapWrite(f->wlog->bytes,byteOffset,buffer,blockSize);
+
+  if (f->fec_k > 0) {
+    /* 
+     * no coalescing, so a lost datagram is a single block a group's 
+     * parity can rebuild; fragmented blocks go unprotected
+     */
+    send_write(&wb);
+    if (!parity_add(&f->parity,&wb)) {
+      send_write_parity(&f->parity);
+      parity_add(&f->parity,&wb);
+    }
+    if (f->parity.hdr.n == f->fec_k)
+      send_write_parity(&f->parity);
+  } else {
+    /* coalesce small writes, a block too big to share a datagram goes alone */
+    struct timeval now;
+    gettimeofday(&now,NULL);
+    if (!batch_add(&f->pending,&wb)) {
+      flush_pending(f);
+      if (!batch_add(&f->pending,&wb)) {
+        send_write(&wb);
+        drop_data(f->wlog,wid);
+      }
+    }
+    if (f->pending.n == 1) {
+      /* the commit thread sends it, should no write follow in time */
+      f->pending_since = now;
+      kick(&commit_box);
+    } else if (time_diff_ms(now,f->pending_since) >= WRITE_COALESCE_MS)
+      flush_pending(f);
+  }
 
+  poll_nacks(f);
 
+  pthread_mutex_unlock(&f->lock);
   return( bytesWritten );
 
 }
@@ -440,57 +1453,35 @@ Commit( int fd ) {
   printf( "Commit: FD=%d\n", fd );
 #endif
 
-	/****************************************************/
-	/* Prepare to Commit Phase			    */
-	/* - Check that all writes made it to the server(s) */
-	/****************************************************/
-
-  int first_wid = ((struct write_block *) CVectorNth(wlog,0))->wid;
-  int last_wid = ((struct write_block *)
-                      CVectorNth(wlog,CVectorCount(wlog)-1))->wid;
-
-  CVector *responders = CVectorCreate(sizeof(struct sockaddr_in), 
-                                      CVectorCount(servers),NULL);
-  CVector *missing = CVectorCreate(sizeof(int),0,NULL);
-
-  int success = ErrorReturn;
-  for (int i=0; i<RETRY_TRY_COMMIT; i++) {
-    send_try_commit(fd, first_wid, last_wid);
-    if ((success = collect_responses(responders,try_commit_handler,
-                        missing, TIMEOUT_TRY_COMMIT)) == NormalReturn)
-      break;
-    retransmit(missing);
-  }
-  CVectorDispose(missing);
-  CVectorDispose(responders);
-
-  if (success != NormalReturn)
-    ERROR("first phase of commit failed");
-
-
-	/****************/
-	/* Commit Phase */
-	/****************/
-
-  responders = CVectorCreate(sizeof(struct sockaddr_in), 
-                                      CVectorCount(servers),NULL);
-  success = ErrorReturn;
-  for (int i=0; i<RETRY_COMMIT; i++) {
-    send_commit(fd, first_wid, last_wid);
-    if ((success = collect_responses(responders,commit_handler,
-                        &fd, TIMEOUT_COMMIT)) == NormalReturn)
-      break;
-  }
-  CVectorDispose(responders);
+  struct open_file *f = lock_file(fd);
+  if (!f)
+    return(ErrorReturn);
+  int success = commit_wait(f);
+  pthread_mutex_unlock(&f->lock);
+  return success;
+}
 
-  if (success != NormalReturn)
-    ERROR("second phase of commit failed");
+/* ------------------------------------------------------------------ */
+/*
+CommitAsync() queues a Commit() of the writes staged so far and returns at once; WriteBlock() on the file can stage the next 
+transaction meanwhile. Commits on one file complete in the order queued. cb(fd, result, ctx) runs on the library's commit 
+thread with what Commit() would have returned, and must not call back into the library for that file. CloseReplFs() waits 
+for the commits still queued and their callbacks. 
 
-  printf("commit successful\n");
+Return value: 0 (NormalReturn) once queued, -1 (ErrorReturn) if the file descriptor is invalid. 
+*/
 
-  reset_log();
-  return( NormalReturn );
+int
+CommitAsync( int fd, ReplFsCommitFn cb, void *ctx ) {
+  ASSERT( fd >= 0 );
+  ASSERT( cb );
 
+  struct open_file *f = lock_file(fd);
+  if (!f)
+    return(ErrorReturn);
+  queue_commit(f,cb,ctx);
+  pthread_mutex_unlock(&f->lock);
+  return(NormalReturn);
 }
 
 /* ------------------------------------------------------------------ */
@@ -516,16 +1507,21 @@ Abort( int fd )
   /* Abort the transaction */
   /*************************/
 
-  if (!wlog)
-    return NormalReturn;
-  
-  int first_wid = ((struct write_block *) CVectorNth(wlog,0))->wid;
-  int last_wid = ((struct write_block *)
-                      CVectorNth(wlog,CVectorCount(wlog)-1))->wid;
+  struct open_file *f = lock_file(fd);
+  if (!f)
+    return(ErrorReturn);
 
-  send_abort(fd,first_wid,last_wid);
-  reset_log();
+  CVector *writes = f->wlog->writes;
+  if (CVectorCount(writes) > 0) {
+    int first_wid = ((struct write_block *) CVectorNth(writes,0))->wid;
+    int last_wid = ((struct write_block *)
+                        CVectorNth(writes,CVectorCount(writes)-1))->wid;
+    netSetGroup(f->group);
+    send_abort(fd,first_wid,last_wid);
+  }
+  reset_log(f);
 
+  pthread_mutex_unlock(&f->lock);
   return(NormalReturn);
 }
 
@@ -549,15 +1545,17 @@ CloseFile( int fd ) {
 	/* Check for Commit or Abort */
 	/*****************************/
 
-  if ( close( fd ) < 0 ) {
-    perror("Close");
+  struct open_file *f = lock_file(fd);
+  if (!f)
     return(ErrorReturn);
-  }
+  mark_closing(f);
 
-  if (wlog && CVectorCount(wlog) > 0)
-    Commit(fd);
+  /* attempt to commit, after any commits still in flight */
+  commit_wait(f);
 
-  reset_log();
+  /* a server that closed already left the file's group */
+  netSetGroup(0);
+  leave_group(f->group);
 
   CVector *responders = CVectorCreate(sizeof(struct sockaddr_in), 
                                       CVectorCount(servers),NULL);
@@ -565,28 +1563,71 @@ CloseFile( int fd ) {
   int success = ErrorReturn;
   for (int i=0; i<RETRY_CLOSE; i++) {
     send_close(fd);
-    if ((success = collect_responses(responders,close_handler,
-                        (void *)&fd, TIMEOUT_CLOSE)) == NormalReturn)
+    if ((success = collect_responses(f,responders,close_handler,
+                        (void *)&fd, i == 0)) == NormalReturn)
       break;
   }
+  CVectorDispose(responders);
 
-  /* attempt to commit */
+  pthread_mutex_unlock(&f->lock);
+  remove_file(f);
 
+  /* 
+   * only now, or an OpenFile() in another thread could be given the fd 
+   * while the servers and the file table still knew it as this file
+   */
+  int closed = close(fd);
   if (success != NormalReturn)
     ERROR("unable to close file remotely");
+  if (closed < 0) {
+    perror("Close");
+    return(ErrorReturn);
+  }
 
   printf("file closed.\n");
 
   return(NormalReturn);
 }
 
+/* ------------------------------------------------------------------ */
+/*
+ReplFsSetFec() sends one XOR parity block after every k writes, from which servers rebuild a single lost write of the group 
+without a retransmit. Writes are then sent one per datagram rather than coalesced. k = 0 turns it off. Takes effect with each 
+open file's next write. 
+
+Return value: 0 (NormalReturn) on success, -1 (ErrorReturn) if k is out of range. 
+*/
+
+int
+ReplFsSetFec( int k ) {
+  if ( k < 0 || k > FEC_MAX_K )
+    return(ErrorReturn);
+  fec_k = k;
+  return(NormalReturn);
+}
+
 /* ------------------------------------------------------------------ */
 
 void 
 CloseReplFs()
 {
+  /* commits still queued run to the end, and their callbacks with them */
+  if (committer_running) {
+    pthread_mutex_lock(&state_lock);
+    stopping = true;
+    pthread_mutex_unlock(&state_lock);
+    kick(&commit_box);
+    pthread_join(committer,NULL);
+    committer_running = false;
+  }
+  CVectorDispose(ops);
+  CVectorDispose(commit_box.mail);
+  pthread_cond_destroy(&commit_box.ready);
+  netLoopDispose(loop);
   netClose();
+  netRingDispose(inbox);
   CVectorDispose(servers);
+  CVectorDispose(files);
 }
 
 
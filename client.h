@@ -32,8 +32,12 @@ extern int InitReplFs(unsigned short portNum, int packetLoss, int numServers);
 extern int OpenFile(char * strFileName);
 extern int WriteBlock(int fd, char * strData, int byteOffset, int blockSize);
 extern int Commit(int fd);
+
+typedef void (*ReplFsCommitFn)(int fd, int result, void *ctx);
+extern int CommitAsync(int fd, ReplFsCommitFn cb, void *ctx);
 extern int Abort(int fd);
 extern int CloseFile(int fd);
+extern int ReplFsSetFec(int k);
 
 #ifdef __cplusplus
 }
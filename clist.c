@@ -6,11 +6,14 @@
 #include <assert.h>
 #include "clist.h"
 
+/* the node holding data, found by identity */
 struct node *
-node_from_data(void * data)
+node_from_data(CList *cl, void *data)
 {
-	return (struct node *) 
-					((char *) data) - offsetof(struct node, data);
+	for (struct node *cur=cl->head; cur != NULL; cur=cur->next)
+		if (cur->data == data)
+			return cur;
+	return NULL;
 }
 
 CList *
@@ -21,6 +24,7 @@ CListInit(CListCleanupElemFn cleanupFn)
 	cl->cleanupFn = cleanupFn;
 	cl->count = 0;
 	cl->head = NULL;
+	cl->tail = NULL;
 	return cl;
 }
 
@@ -31,7 +35,11 @@ CListInsertSort(CList *cl, CListCmpElemFn compareFn,
 {
 	assert(cl);
 	struct node *nd = malloc(sizeof(struct node));
+	assert(nd);
 	nd->data = data;
+	nd->next = NULL;
+	nd->prev = NULL;
+	cl->count++;
 
 	/* empy list */
 	if (cl->head == NULL) {
@@ -41,8 +49,8 @@ CListInsertSort(CList *cl, CListCmpElemFn compareFn,
 	}
 
 	/* insert at middle */
-	for (struct node *cur=cl->head; cl != NULL; cur=cur->next) {
-		if (compareFn(nd,cur) > 0) {
+	for (struct node *cur=cl->head; cur != NULL; cur=cur->next) {
+		if (compareFn(nd->data,cur->data) < 0) {
 			nd->next = cur;
 			nd->prev = cur->prev;
 			nd->next->prev = nd;
@@ -56,8 +64,7 @@ CListInsertSort(CList *cl, CListCmpElemFn compareFn,
 
 	/* insert at tail */
 	nd->prev = cl->tail;
-	nd->next = NULL;
-	nd->prev->next = cl->tail;
+	nd->prev->next = nd;
 	cl->tail = nd;
 }
 
@@ -67,7 +74,9 @@ CListInsertSort(CList *cl, CListCmpElemFn compareFn,
 void CListRemove(CList *cl, void *data)
 {
 	assert(cl);
-	struct node *nd = node_from_data(data);
+	struct node *nd = node_from_data(cl,data);
+	if (!nd)
+		return;
 	if (nd->prev)
 		nd->prev->next = nd->next;
 	else
@@ -78,8 +87,10 @@ void CListRemove(CList *cl, void *data)
 	else
 		cl->tail = nd->prev;
 
-	cl->cleanupFn(nd);
+	if (cl->cleanupFn)
+		cl->cleanupFn(nd->data);
 	free(nd);
+	cl->count--;
 }
 
 void CListDestory(CList *cl)
@@ -88,7 +99,8 @@ void CListDestory(CList *cl)
 	for (struct node *cur=cl->head; cur != NULL; ) {
 		struct node *old = cur;
 		cur=cur->next;
-		cl->cleanupFn(old->data);
+		if (cl->cleanupFn)
+			cl->cleanupFn(old->data);
 		free(old);
 	}
 	free(cl);
@@ -106,7 +118,7 @@ void *CListNext(CList *cl, void *data)
 {
 	assert(cl);
 	if (!data) return NULL;
-	struct node *nd = node_from_data(data);
-	if (!nd->next)	return NULL;
+	struct node *nd = node_from_data(cl,data);
+	if (!nd || !nd->next)	return NULL;
 	return nd->next->data;
 }
@@ -30,7 +30,7 @@ CListInsertSort(CList *cl, CListCmpElemFn compareFn,
 
 
 /*data is unavailable after this operation*/
-void CListRemove(CList *cl, CListCmpElemFn compareFn, void *data);
+void CListRemove(CList *cl, void *data);
 
 void CListDestory(CList *cl);
 
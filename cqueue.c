@@ -0,0 +1,55 @@
+#include <stdlib.h>
+#include <assert.h>
+
+#include "cqueue.h"
+
+void
+CQueueInit(CQueue *q)
+{
+	assert(q);
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+void
+CQueuePush(CQueue *q, CQueueNode *node)
+{
+	__atomic_store_n(&node->next,NULL,__ATOMIC_RELAXED);
+	CQueueNode *prev = __atomic_exchange_n(&q->head,node,__ATOMIC_ACQ_REL);
+	/* between the exchange and this store the queue is briefly unlinked */
+	__atomic_store_n(&prev->next,node,__ATOMIC_RELEASE);
+}
+
+CQueueNode *
+CQueuePop(CQueue *q)
+{
+	CQueueNode *tail = q->tail;
+	CQueueNode *next = __atomic_load_n(&tail->next,__ATOMIC_ACQUIRE);
+
+	/* skip over the stub */
+	if (tail == &q->stub) {
+		if (!next)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next,__ATOMIC_ACQUIRE);
+	}
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	/* tail is the last node, unless a push is midway */
+	if (tail != __atomic_load_n(&q->head,__ATOMIC_ACQUIRE))
+		return NULL;
+
+	/* put the stub behind it, so tail can be handed out */
+	CQueuePush(q,&q->stub);
+	next = __atomic_load_n(&tail->next,__ATOMIC_ACQUIRE);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef __CQUEUE_H__
+#define __CQUEUE_H__
+
+#include <stddef.h>
+
+/*
+ * Intrusive lock-free queue for many producers and one consumer (Vyukov's
+ * MPSC). Elements embed a CQueueNode and are never copied or allocated by
+ * the queue. Push is a single atomic exchange, pop takes no atomic
+ * read-modify-write at all. The two ends sit on separate cache lines.
+ */
+#define CACHE_LINE 64
+
+typedef struct cqueue_node {
+	struct cqueue_node *next;
+} CQueueNode;
+
+typedef struct cqueue {
+	CQueueNode *head __attribute__((aligned(CACHE_LINE)));	/* producers */
+	CQueueNode *tail __attribute__((aligned(CACHE_LINE)));	/* consumer */
+	CQueueNode stub;
+} CQueue;
+
+/* the element a node is embedded in */
+#define CQueueEntry(node, type, member) \
+	((type *) ((char *) (node) - offsetof(type, member)))
+
+void CQueueInit(CQueue *q);
+
+/* safe from any thread */
+void CQueuePush(CQueue *q, CQueueNode *node);
+
+/*
+ * Consumer only. Returns NULL when empty, and also for the moment a push
+ * has swapped in its node but not linked it yet; that push completes
+ * shortly and the node is returned by a later pop.
+ */
+CQueueNode *CQueuePop(CQueue *q);
+
+#endif
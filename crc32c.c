@@ -0,0 +1,106 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "crc32c.h"
+
+#define POLY 0x82f63b78		/* reflected Castagnoli polynomial */
+
+static uint32_t table[8][256];
+
+static void
+build_table()
+{
+	for (int i=0; i<256; i++) {
+		uint32_t crc = i;
+		for (int k=0; k<8; k++)
+			crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+		table[0][i] = crc;
+	}
+	for (int i=0; i<256; i++)
+		for (int t=1; t<8; t++)
+			table[t][i] = (table[t-1][i] >> 8) ^ table[0][table[t-1][i] & 0xff];
+}
+
+/* slicing-by-8: eight table lookups per 64-bit word */
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len && ((uintptr_t)p & 7)) {
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t w;
+		memcpy(&w,p,8);
+		w ^= crc;
+		crc = table[7][w & 0xff] ^ table[6][(w >> 8) & 0xff] ^
+					table[5][(w >> 16) & 0xff] ^ table[4][(w >> 24) & 0xff] ^
+					table[3][(w >> 32) & 0xff] ^ table[2][(w >> 40) & 0xff] ^
+					table[1][(w >> 48) & 0xff] ^ table[0][w >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len && ((uintptr_t)p & 7)) {
+		crc = _mm_crc32_u8(crc,*p++);
+		len--;
+	}
+	uint64_t crc64 = crc;
+	while (len >= 8) {
+		uint64_t w;
+		memcpy(&w,p,8);
+		crc64 = _mm_crc32_u64(crc64,w);
+		p += 8;
+		len -= 8;
+	}
+	crc = (uint32_t) crc64;
+	while (len--)
+		crc = _mm_crc32_u8(crc,*p++);
+	return crc;
+}
+
+static bool
+have_sse42()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+}
+#else
+#define crc32c_hw crc32c_sw
+static bool have_sse42() { return false; }
+#endif
+
+/* chosen once, by whichever thread gets here first */
+static uint32_t (*impl)(uint32_t, const unsigned char *, size_t);
+static pthread_once_t impl_once = PTHREAD_ONCE_INIT;
+
+static void
+pick_impl()
+{
+	if (have_sse42()) {
+		impl = crc32c_hw;
+	} else {
+		build_table();
+		impl = crc32c_sw;
+	}
+}
+
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&impl_once,pick_impl);
+	return ~impl(~crc, (const unsigned char *) buf, len);
+}
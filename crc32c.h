@@ -0,0 +1,14 @@
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 
+ * CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has
+ * it and slicing-by-8 tables otherwise. Pass the previous result as crc to
+ * continue a checksum across buffers; start with 0.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
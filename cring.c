@@ -0,0 +1,91 @@
+#define _POSIX_C_SOURCE 200112L	/* posix_memalign() */
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "cring.h"
+#include "cqueue.h"
+
+struct cring {
+	/* consumer's line */
+	unsigned long head __attribute__((aligned(CACHE_LINE)));
+	unsigned long tail_cache;
+	/* producer's line */
+	unsigned long tail __attribute__((aligned(CACHE_LINE)));
+	unsigned long head_cache;
+	/* read-only after create */
+	char *elems __attribute__((aligned(CACHE_LINE)));
+	size_t elemSize;
+	unsigned long mask;
+};
+
+CRing *
+CRingCreate(size_t elemSize, int capacity)
+{
+	assert(elemSize > 0 && capacity > 0);
+	CRing *r;
+	if (posix_memalign((void **) &r,CACHE_LINE,sizeof(struct cring)))
+		r = NULL;
+	assert(r);
+	unsigned long slots = 1;
+	while (slots < (unsigned long) capacity)
+		slots *= 2;
+	r->elems = malloc(slots * elemSize);
+	assert(r->elems);
+	r->elemSize = elemSize;
+	r->mask = slots - 1;
+	r->head = r->tail_cache = 0;
+	r->tail = r->head_cache = 0;
+	return r;
+}
+
+void
+CRingDispose(CRing *r)
+{
+	assert(r);
+	free(r->elems);
+	free(r);
+}
+
+bool
+CRingPush(CRing *r, const void *elemAddr)
+{
+	unsigned long tail = r->tail;
+	if (tail - r->head_cache > r->mask) {
+		r->head_cache = __atomic_load_n(&r->head,__ATOMIC_ACQUIRE);
+		if (tail - r->head_cache > r->mask)
+			return false;
+	}
+	memcpy(r->elems + (tail & r->mask) * r->elemSize,elemAddr,r->elemSize);
+	__atomic_store_n(&r->tail,tail + 1,__ATOMIC_RELEASE);
+	return true;
+}
+
+void *
+CRingPeek(CRing *r)
+{
+	unsigned long head = r->head;
+	if (head == r->tail_cache) {
+		r->tail_cache = __atomic_load_n(&r->tail,__ATOMIC_ACQUIRE);
+		if (head == r->tail_cache)
+			return NULL;
+	}
+	return r->elems + (head & r->mask) * r->elemSize;
+}
+
+void
+CRingDrop(CRing *r)
+{
+	__atomic_store_n(&r->head,r->head + 1,__ATOMIC_RELEASE);
+}
+
+bool
+CRingPop(CRing *r, void *elemAddr)
+{
+	void *elem = CRingPeek(r);
+	if (!elem)
+		return false;
+	memcpy(elemAddr,elem,r->elemSize);
+	CRingDrop(r);
+	return true;
+}
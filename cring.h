@@ -0,0 +1,30 @@
+#ifndef __CRING_H__
+#define __CRING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Bounded lock-free ring for one producer and one consumer. Elements are
+ * copied in and out, elemSize bytes each. Each side keeps its index on 
+ * its own cache line, with a cached copy of the other side's, so the 
+ * shared lines only move when the cached copy runs out.
+ */
+typedef struct cring CRing;
+
+/* capacity is rounded up to a power of two */
+CRing *CRingCreate(size_t elemSize, int capacity);
+
+void CRingDispose(CRing *r);
+
+/* producer only, false when full */
+bool CRingPush(CRing *r, const void *elemAddr);
+
+/* consumer only, false when empty */
+bool CRingPop(CRing *r, void *elemAddr);
+
+/* the slot CRingPop() would copy out, or NULL; CRingDrop() releases it */
+void *CRingPeek(CRing *r);
+void CRingDrop(CRing *r);
+
+#endif
@@ -0,0 +1,415 @@
+#define _GNU_SOURCE		/* pwritev(), syscall(), fdatasync() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#include "disk.h"
+#include "utils.h"
+
+#define URING_ENTRIES 256
+
+struct batch {
+	int fd;
+	int npending;			/* writes not yet complete */
+	int result;
+	DiskDoneFn done;
+	void *aux;
+};
+
+/* one extent, resubmitted from where it got to after a short write */
+struct write {
+	struct write *next;
+	struct batch *batch;
+	off_t offset;
+	struct iovec iov;
+	bool sync;				/* an fdatasync rather than a write */
+	int res;					/* for the posix backend */
+};
+
+/* a singly linked FIFO of writes */
+struct writes {
+	struct write *head;
+	struct write *tail;
+};
+
+struct backend {
+	const char *name;
+	int (*init)(Disk *d);
+	void (*submit)(Disk *d);	/* hands the queued writes to the kernel */
+	void (*reap)(Disk *d);		/* completes the writes the kernel is done with */
+	void (*dispose)(Disk *d);
+};
+
+struct uring {
+	int fd;
+	void *sq_ring, *cq_ring;
+	size_t sq_len, cq_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned entries;
+	unsigned inflight;
+};
+
+struct disk {
+	const struct backend *backend;
+	int efd;
+	struct writes queued;
+	struct writes finished;		/* posix: written, not yet completed */
+	struct uring ring;
+};
+
+static void
+push(struct writes *q, struct write *w)
+{
+	w->next = NULL;
+	if (q->tail)
+		q->tail->next = w;
+	else
+		q->head = w;
+	q->tail = w;
+}
+
+static struct write *
+pop(struct writes *q)
+{
+	struct write *w = q->head;
+	if (w && !(q->head = w->next))
+		q->tail = NULL;
+	return w;
+}
+
+/* res is what the write returned, or -errno */
+static void
+complete(Disk *d, struct write *w, int res)
+{
+	if (res == -EINTR || res == -EAGAIN) {
+		push(&d->queued,w);
+		return;
+	}
+	if (res < 0) {
+		fprintf(stderr,"disk write failed: %s\n",strerror(-res));
+		w->batch->result = ErrorReturn;
+	} else if (res == 0 && w->iov.iov_len > 0) {
+		/* would be requeued forever */
+		fprintf(stderr,"disk write made no progress\n");
+		w->batch->result = ErrorReturn;
+	} else if ((size_t) res < w->iov.iov_len) {
+		w->offset += res;
+		w->iov.iov_base = (char *) w->iov.iov_base + res;
+		w->iov.iov_len -= res;
+		push(&d->queued,w);
+		return;
+	}
+
+	struct batch *b = w->batch;
+	free(w);
+	if (--b->npending == 0) {
+		b->done(b->result,b->aux);
+		free(b);
+	}
+}
+
+/* posix: the writes happen at submission, completions come on the next reap */
+static int
+posix_init(Disk *d)
+{
+	return 0;
+}
+
+static void
+posix_submit(Disk *d)
+{
+	struct write *w;
+	bool any = false;
+	while ((w = pop(&d->queued)) != NULL) {
+		ssize_t n = w->sync ? fdatasync(w->batch->fd) :
+								w->iov.iov_len ? pwritev(w->batch->fd,&w->iov,1,w->offset) : 0;
+		w->res = n < 0 ? -errno : n;
+		push(&d->finished,w);
+		any = true;
+	}
+	uint64_t one = 1;
+	if (any && write(d->efd,&one,sizeof(one)) < 0)
+		perror("eventfd");
+}
+
+static void
+posix_reap(Disk *d)
+{
+	struct writes done = d->finished;
+	d->finished.head = d->finished.tail = NULL;
+	struct write *w;
+	while ((w = pop(&done)) != NULL)
+		complete(d,w,w->res);
+}
+
+static void
+posix_dispose(Disk *d)
+{
+}
+
+static const struct backend posix_backend = {
+	"posix", posix_init, posix_submit, posix_reap, posix_dispose
+};
+
+/* io_uring, through the raw syscalls: one ring, completions signal efd */
+
+/* the ring's mappings, those that were made */
+static void
+uring_unmap(struct uring *r)
+{
+	if (r->sqes != MAP_FAILED)
+		munmap(r->sqes,r->sqes_len);
+	if (r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring,r->cq_len);
+	if (r->sq_ring != MAP_FAILED)
+		munmap(r->sq_ring,r->sq_len);
+}
+
+static int
+uring_init(Disk *d)
+{
+	struct uring *r = &d->ring;
+	struct io_uring_params p;
+	memset(&p,0,sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup,URING_ENTRIES,&p);
+	if (r->fd < 0)
+		return -1;
+
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single && r->cq_len > r->sq_len)
+		r->sq_len = r->cq_len;
+	r->sq_ring = mmap(NULL,r->sq_len,PROT_READ | PROT_WRITE,
+										MAP_SHARED | MAP_POPULATE,r->fd,IORING_OFF_SQ_RING);
+	r->cq_ring = single ? r->sq_ring :
+							 mmap(NULL,r->cq_len,PROT_READ | PROT_WRITE,
+										MAP_SHARED | MAP_POPULATE,r->fd,IORING_OFF_CQ_RING);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL,r->sqes_len,PROT_READ | PROT_WRITE,
+								 MAP_SHARED | MAP_POPULATE,r->fd,IORING_OFF_SQES);
+	if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED ||
+			r->sqes == MAP_FAILED) {
+		uring_unmap(r);
+		close(r->fd);
+		return -1;
+	}
+
+	char *sq = r->sq_ring, *cq = r->cq_ring;
+	r->sq_head = (unsigned *) (sq + p.sq_off.head);
+	r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *) (sq + p.sq_off.array);
+	r->cq_head = (unsigned *) (cq + p.cq_off.head);
+	r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	/* never more in flight than the completion ring holds */
+	r->entries = p.sq_entries < p.cq_entries ? p.sq_entries : p.cq_entries;
+	r->inflight = 0;
+
+	if (syscall(__NR_io_uring_register,r->fd,IORING_REGISTER_EVENTFD,
+							&d->efd,1) < 0) {
+		d->backend->dispose(d);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+uring_submit(Disk *d)
+{
+	struct uring *r = &d->ring;
+	unsigned tail = *r->sq_tail;
+	while (r->inflight < r->entries && d->queued.head) {
+		struct write *w = pop(&d->queued);
+		unsigned index = tail & *r->sq_mask;
+		struct io_uring_sqe *sqe = &r->sqes[index];
+		memset(sqe,0,sizeof(*sqe));
+		sqe->fd = w->batch->fd;
+		if (w->sync) {
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		} else {
+			sqe->opcode = w->iov.iov_len ? IORING_OP_WRITEV : IORING_OP_NOP;
+			sqe->addr = (uintptr_t) &w->iov;
+			sqe->len = 1;
+			sqe->off = w->offset;
+		}
+		sqe->user_data = (uintptr_t) w;
+		r->sq_array[index] = index;
+		tail++;
+		r->inflight++;
+	}
+	__atomic_store_n(r->sq_tail,tail,__ATOMIC_RELEASE);
+	/* including any a failed enter left in the ring */
+	unsigned n = tail - __atomic_load_n(r->sq_head,__ATOMIC_ACQUIRE);
+	if (n == 0)
+		return;
+	while (syscall(__NR_io_uring_enter,r->fd,n,0,0,NULL,0) < 0) {
+		if (errno != EINTR) {
+			perror("io_uring_enter");
+			break;
+		}
+	}
+}
+
+static void
+uring_reap(Disk *d)
+{
+	struct uring *r = &d->ring;
+	unsigned head = *r->cq_head;
+	unsigned tail = __atomic_load_n(r->cq_tail,__ATOMIC_ACQUIRE);
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+		struct write *w = (struct write *) (uintptr_t) cqe->user_data;
+		int res = cqe->res;
+		/* the slot is free before the callback, which may submit more */
+		__atomic_store_n(r->cq_head,++head,__ATOMIC_RELEASE);
+		r->inflight--;
+		complete(d,w,res);
+	}
+}
+
+static void
+uring_dispose(Disk *d)
+{
+	struct uring *r = &d->ring;
+	uring_unmap(r);
+	close(r->fd);
+}
+
+static const struct backend uring_backend = {
+	"io_uring", uring_init, uring_submit, uring_reap, uring_dispose
+};
+
+static const struct backend *backends[] = { &uring_backend, &posix_backend };
+
+Disk *
+DiskCreate(const char *backend)
+{
+	Disk *d = calloc(1,sizeof(struct disk));
+	assert(d);
+	d->efd = eventfd(0,EFD_NONBLOCK);
+	if (d->efd < 0) {
+		free(d);
+		return NULL;
+	}
+	int n = sizeof(backends) / sizeof(backends[0]);
+	for (int i=0; i<n; i++) {
+		if (backend && strcmp(backend,backends[i]->name))
+			continue;
+		d->backend = backends[i];
+		if (backends[i]->init(d) == 0)
+			return d;
+	}
+	close(d->efd);
+	free(d);
+	return NULL;
+}
+
+void
+DiskDispose(Disk *d)
+{
+	assert(d);
+	d->backend->dispose(d);
+	close(d->efd);
+	free(d);
+}
+
+const char *
+DiskName(Disk *d)
+{
+	assert(d);
+	return d->backend->name;
+}
+
+int
+DiskEventFd(Disk *d)
+{
+	assert(d);
+	return d->efd;
+}
+
+static struct batch *
+new_batch(int fd, DiskDoneFn done, void *aux)
+{
+	struct batch *b = malloc(sizeof(struct batch));
+	assert(b);
+	b->fd = fd;
+	b->npending = 0;
+	b->result = NormalReturn;
+	b->done = done;
+	b->aux = aux;
+	return b;
+}
+
+static void
+queue_write(Disk *d, struct batch *b, off_t offset, char *data, int len,
+						bool sync)
+{
+	struct write *w = calloc(1,sizeof(struct write));
+	assert(w);
+	w->batch = b;
+	w->offset = offset;
+	w->iov.iov_base = data;
+	w->iov.iov_len = len;
+	w->sync = sync;
+	push(&d->queued,w);
+	b->npending++;
+}
+
+void
+DiskSubmit(Disk *d, int fd, ExtMap *extents, DiskDoneFn done, void *aux)
+{
+	assert(d);
+	struct batch *b = new_batch(fd,done,aux);
+	for (struct extent *e = ExtMapFirst(extents); e; e = ExtMapNext(extents,e))
+		queue_write(d,b,e->offset,e->data,e->len,false);
+	/* an empty batch still completes, through one empty write */
+	if (b->npending == 0)
+		queue_write(d,b,0,NULL,0,false);
+	d->backend->submit(d);
+}
+
+void
+DiskWrite(Disk *d, int fd, off_t offset, char *data, int len, 
+					DiskDoneFn done, void *aux)
+{
+	assert(d);
+	queue_write(d,new_batch(fd,done,aux),offset,data,len,false);
+	d->backend->submit(d);
+}
+
+void
+DiskSync(Disk *d, int fd, DiskDoneFn done, void *aux)
+{
+	assert(d);
+	queue_write(d,new_batch(fd,done,aux),0,NULL,0,true);
+	d->backend->submit(d);
+}
+
+void
+DiskReap(Disk *d)
+{
+	assert(d);
+	uint64_t n;
+	if (read(d->efd,&n,sizeof(n)) < 0 && errno != EAGAIN)
+		perror("eventfd");
+	d->backend->reap(d);
+	d->backend->submit(d);
+}
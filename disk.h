@@ -0,0 +1,43 @@
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include <sys/types.h>
+#include "extmap.h"
+
+/*
+ * Storage backend for the server's disk thread. A batch of writes goes in
+ * at once and completes asynchronously: DiskEventFd turns readable, and
+ * DiskReap then runs the callback of every batch finished since. Batches
+ * on one file may complete in any order, callers keep them apart.
+ *
+ * Backends are io_uring, driven through raw syscalls, and posix, which
+ * does the writes with pwrite at submission.
+ */
+typedef struct disk Disk;
+
+/* result is NormalReturn once every write landed, ErrorReturn otherwise */
+typedef void (*DiskDoneFn)(int result, void *aux);
+
+/* the named backend, or with NULL the best one the kernel supports */
+Disk *DiskCreate(const char *backend);
+
+void DiskDispose(Disk *d);
+
+const char *DiskName(Disk *d);
+
+int DiskEventFd(Disk *d);
+
+/* writes every extent of the map to fd, which must stay open until done */
+void DiskSubmit(Disk *d, int fd, ExtMap *extents, DiskDoneFn done, void *aux);
+
+/* one buffer, which must stay valid until done */
+void DiskWrite(Disk *d, int fd, off_t offset, char *data, int len, 
+							 DiskDoneFn done, void *aux);
+
+/* an fdatasync, covering the writes to fd that completed before it */
+void DiskSync(Disk *d, int fd, DiskDoneFn done, void *aux);
+
+/* completes what has finished, and submits what was waiting for room */
+void DiskReap(Disk *d);
+
+#endif
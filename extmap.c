@@ -0,0 +1,160 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "extmap.h"
+#include "cvector.h"
+
+struct extmap {
+	CVector *extents;		/* struct extent, by offset */
+	long bytes;
+};
+
+static void
+extent_free(void *e)
+{
+	free(((struct extent *) e)->data);
+}
+
+static struct extent *
+nth(ExtMap *em, int i)
+{
+	return (struct extent *) CVectorNth(em->extents,i);
+}
+
+static int
+end_of(struct extent *e)
+{
+	return e->offset + e->len;
+}
+
+/* index of the first extent ending at or past offset */
+static int
+first_reaching(ExtMap *em, int offset)
+{
+	int lo = 0, hi = CVectorCount(em->extents);
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (end_of(nth(em,mid)) < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+ExtMap *
+ExtMapCreate()
+{
+	ExtMap *em = malloc(sizeof(struct extmap));
+	assert(em);
+	em->extents = CVectorCreate(sizeof(struct extent),0,extent_free);
+	em->bytes = 0;
+	return em;
+}
+
+void
+ExtMapDispose(ExtMap *em)
+{
+	assert(em);
+	CVectorDispose(em->extents);
+	free(em);
+}
+
+/*
+ * The write and every extent it overlaps or touches become one extent.
+ * When the first of those starts at or before the write, its buffer is
+ * grown in place, so a run of appends costs amortized O(len).
+ */
+void
+ExtMapWrite(ExtMap *em, int offset, const char *data, int len)
+{
+	assert(em);
+	if (len <= 0)
+		return;
+	int end = offset + len;
+	int from = first_reaching(em,offset);
+	int to = from;
+	while (to < CVectorCount(em->extents) && nth(em,to)->offset <= end)
+		to++;
+
+	if (from == to) {
+		struct extent e = { offset, len, malloc(len) };
+		assert(e.data);
+		memcpy(e.data,data,len);
+		CVectorInsert(em->extents,&e,from);
+		em->bytes += len;
+		return;
+	}
+
+	struct extent *first = nth(em,from), *last = nth(em,to-1);
+	int lo = first->offset < offset ? first->offset : offset;
+	int hi = end_of(last) > end ? end_of(last) : end;
+	bool in_place = first->offset == lo;
+	char *buf = in_place ? realloc(first->data,hi - lo) : malloc(hi - lo);
+	assert(buf);
+	if (in_place)
+		first->data = buf;
+	/* in place, the first extent's tail is already where it belongs */
+	if (end_of(last) > end && !(in_place && last == first))
+		memcpy(buf + (end - lo),last->data + (end - last->offset),
+					 end_of(last) - end);
+	memcpy(buf + (offset - lo),data,len);
+
+	for (int i=from; i<to; i++)
+		em->bytes -= nth(em,i)->len;
+	for (int i=to-1; i>from; i--)
+		CVectorRemove(em->extents,i);
+	first = nth(em,from);
+	if (!in_place)
+		free(first->data);
+	first->offset = lo;
+	first->len = hi - lo;
+	first->data = buf;
+	em->bytes += hi - lo;
+}
+
+bool
+ExtMapRead(ExtMap *em, int offset, int len, char *buf)
+{
+	assert(em);
+	int pos = offset, end = offset + len;
+	for (int i=first_reaching(em,offset + 1);
+			 pos < end && i < CVectorCount(em->extents); i++) {
+		struct extent *e = nth(em,i);
+		if (e->offset > pos)
+			return false;
+		int stop = end_of(e) < end ? end_of(e) : end;
+		memcpy(buf + (pos - offset),e->data + (pos - e->offset),stop - pos);
+		pos = stop;
+	}
+	return pos >= end;
+}
+
+int
+ExtMapCount(ExtMap *em)
+{
+	assert(em);
+	return CVectorCount(em->extents);
+}
+
+long
+ExtMapBytes(ExtMap *em)
+{
+	assert(em);
+	return em->bytes;
+}
+
+struct extent *
+ExtMapFirst(ExtMap *em)
+{
+	assert(em);
+	return (struct extent *) CVectorFirst(em->extents);
+}
+
+struct extent *
+ExtMapNext(ExtMap *em, struct extent *e)
+{
+	assert(em);
+	return (struct extent *) CVectorNext(em->extents,e);
+}
@@ -0,0 +1,40 @@
+#ifndef __EXTMAP_H__
+#define __EXTMAP_H__
+
+#include <stdbool.h>
+
+/*
+ * The bytes a run of writes leaves behind, as a sorted list of disjoint
+ * extents. A write replaces whatever it overlaps, and extents that come
+ * to touch are merged, so the map never holds more than the distinct
+ * bytes written, however often they are rewritten.
+ */
+typedef struct extmap ExtMap;
+
+struct extent {
+	int offset;
+	int len;
+	char *data;
+};
+
+ExtMap *ExtMapCreate();
+
+void ExtMapDispose(ExtMap *em);
+
+/* copies the bytes into the map, over anything written there before */
+void ExtMapWrite(ExtMap *em, int offset, const char *data, int len);
+
+/* copies out [offset,offset+len), false if the map does not cover it all */
+bool ExtMapRead(ExtMap *em, int offset, int len, char *buf);
+
+int ExtMapCount(ExtMap *em);
+
+/* bytes held, the sum of the extents' lengths */
+long ExtMapBytes(ExtMap *em);
+
+/* iteration in offset order, the map must not change in the midst of it */
+struct extent *ExtMapFirst(ExtMap *em);
+
+struct extent *ExtMapNext(ExtMap *em, struct extent *e);
+
+#endif
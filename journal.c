@@ -0,0 +1,431 @@
+#define _GNU_SOURCE		/* syncfs() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "journal.h"
+#include "utils.h"
+#include "crc32c.h"
+#include "cvector.h"
+
+#define JOURNAL_MAGIC 0x4c4e524a	/* "JRNL" */
+#define JOURNAL_PATH_LEN (2 * JOURNAL_NAME_LEN + sizeof(JOURNAL_NAME))
+
+struct record_header {
+	uint32_t magic;
+	uint32_t crc;				/* crc32c of the record from len on */
+	uint32_t len;				/* of the whole record */
+	uint32_t nextents;
+	char name[JOURNAL_NAME_LEN];
+};
+
+/* each extent of a record: this, then its bytes */
+struct record_extent {
+	int32_t offset;
+	int32_t len;
+};
+
+struct record {
+	Journal *j;
+	char *buf;
+	int len;
+	JournalDoneFn done;
+	void *aux;
+};
+
+struct journal {
+	int fd;
+	Disk *disk;
+	int timer;
+	bool timer_armed;
+	off_t end;
+	int writing;					/* records submitted, not yet landed */
+	bool sync_wanted;			/* the group's window has closed */
+	bool syncing;
+	bool broken;					/* a record or sync failed, until a checkpoint */
+	CVector *landed;			/* struct record *, waiting for a sync */
+	CVector *group;				/* covered by the sync in flight */
+	CVector *deferred;		/* held back until that sync has started */
+};
+
+static void
+journal_path(const char *dir, char *path)
+{
+	snprintf(path,JOURNAL_PATH_LEN,"%s%s",dir,JOURNAL_NAME);
+}
+
+/* fdatasync on the journal does not cover its directory entry, this does */
+static int
+sync_dir(const char *dir)
+{
+	int fd = open(dir,O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || fsync(fd) < 0) {
+		perror("unable to sync the mount directory");
+		if (fd >= 0)
+			close(fd);
+		return ErrorReturn;
+	}
+	close(fd);
+	return NormalReturn;
+}
+
+static struct record *
+make_record(const char *name, ExtMap *extents)
+{
+	int len = sizeof(struct record_header);
+	for (struct extent *e = ExtMapFirst(extents); e; e = ExtMapNext(extents,e))
+		len += sizeof(struct record_extent) + e->len;
+
+	struct record *r = calloc(1,sizeof(struct record));
+	assert(r);
+	r->buf = malloc(len);
+	assert(r->buf);
+	r->len = len;
+
+	struct record_header *h = (struct record_header *) r->buf;
+	memset(h,0,sizeof(*h));
+	h->magic = JOURNAL_MAGIC;
+	h->len = len;
+	h->nextents = ExtMapCount(extents);
+	strncpy(h->name,name,JOURNAL_NAME_LEN - 1);
+	char *p = r->buf + sizeof(*h);
+	for (struct extent *e = ExtMapFirst(extents); e; e = ExtMapNext(extents,e)) {
+		struct record_extent re = { e->offset, e->len };
+		memcpy(p,&re,sizeof(re));
+		memcpy(p + sizeof(re),e->data,e->len);
+		p += sizeof(re) + e->len;
+	}
+	size_t from = offsetof(struct record_header,len);
+	h->crc = crc32c(0,r->buf + from,len - from);
+	return r;
+}
+
+static void
+fail_records(CVector *records)
+{
+	for (int i=0; i<CVectorCount(records); i++) {
+		struct record *r = *(struct record **) CVectorNth(records,i);
+		r->done(ErrorReturn,r->aux);
+		free(r->buf);
+		free(r);
+	}
+	while (CVectorCount(records) > 0)
+		CVectorRemove(records,CVectorCount(records) - 1);
+}
+
+static void record_landed(int result, void *aux);
+static void group_synced(int result, void *aux);
+
+static void
+submit_record(Journal *j, struct record *r)
+{
+	off_t offset = j->end;
+	j->end += r->len;
+	j->writing++;
+	DiskWrite(j->disk,j->fd,offset,r->buf,r->len,record_landed,r);
+}
+
+/*
+ * A sync starts once the window has closed and no record is still being
+ * written, so no acknowledged record ever lies past a hole in the journal.
+ * Records arriving meanwhile wait, or they could hold the sync off forever.
+ */
+static void
+maybe_sync(Journal *j)
+{
+	if (!j->sync_wanted || j->syncing || j->writing > 0)
+		return;
+	j->sync_wanted = false;
+	if (j->broken) {
+		fail_records(j->landed);
+	} else if (CVectorCount(j->landed) > 0) {
+		CVector *group = j->group;
+		j->group = j->landed;
+		j->landed = group;
+		j->syncing = true;
+		DiskSync(j->disk,j->fd,group_synced,j);
+	}
+	while (CVectorCount(j->deferred) > 0 && !j->sync_wanted) {
+		struct record *r = *(struct record **) CVectorNth(j->deferred,0);
+		CVectorRemove(j->deferred,0);
+		submit_record(j,r);
+	}
+}
+
+static void
+open_window(Journal *j)
+{
+	if (j->timer_armed)
+		return;
+	struct timeval due;
+	gettimeofday(&due,NULL);
+	due.tv_usec += JOURNAL_WINDOW_US;
+	if (due.tv_usec >= MICROSEC_IN_SEC) {
+		due.tv_sec++;
+		due.tv_usec -= MICROSEC_IN_SEC;
+	}
+	netTimerArm(j->timer,due);
+	j->timer_armed = true;
+}
+
+static void
+on_window(void *aux)
+{
+	Journal *j = (Journal *) aux;
+	j->timer_armed = false;
+	j->sync_wanted = true;
+	maybe_sync(j);
+}
+
+static void
+record_landed(int result, void *aux)
+{
+	struct record *r = (struct record *) aux;
+	Journal *j = r->j;
+	j->writing--;
+	free(r->buf);
+	r->buf = NULL;
+	if (result != NormalReturn) {
+		fprintf(stderr,"unable to write the journal\n");
+		j->broken = true;
+		r->done(ErrorReturn,r->aux);
+		free(r);
+	} else {
+		CVectorAppend(j->landed,&r);
+		open_window(j);
+	}
+	maybe_sync(j);
+}
+
+static void
+group_synced(int result, void *aux)
+{
+	Journal *j = (Journal *) aux;
+	j->syncing = false;
+	if (result != NormalReturn) {
+		fprintf(stderr,"unable to sync the journal\n");
+		j->broken = true;
+	}
+	printf("journal sync covered %d commit(s)\n",CVectorCount(j->group));
+	CVector *group = j->group;
+	j->group = CVectorCreate(sizeof(struct record *),0,NULL);
+	for (int i=0; i<CVectorCount(group); i++) {
+		struct record *r = *(struct record **) CVectorNth(group,i);
+		r->done(result,r->aux);
+		free(r);
+	}
+	CVectorDispose(group);
+	if (CVectorCount(j->landed) > 0)
+		open_window(j);
+	maybe_sync(j);
+}
+
+Journal *
+JournalOpen(const char *dir, Disk *disk, struct net_loop *loop)
+{
+	char path[JOURNAL_PATH_LEN];
+	journal_path(dir,path);
+	Journal *j = calloc(1,sizeof(struct journal));
+	assert(j);
+	j->fd = open(path,O_RDWR | O_CREAT,S_IRUSR | S_IWUSR);
+	if (j->fd < 0) {
+		perror("unable to open the journal");
+		free(j);
+		return NULL;
+	}
+	/* or a power failure could take the journal, and every commit in it */
+	if (sync_dir(dir) != NormalReturn) {
+		close(j->fd);
+		free(j);
+		return NULL;
+	}
+	if ((j->timer = netTimerCreate(loop,on_window,j)) < 0) {
+		close(j->fd);
+		free(j);
+		return NULL;
+	}
+	j->disk = disk;
+	j->end = lseek(j->fd,0,SEEK_END);
+	j->landed = CVectorCreate(sizeof(struct record *),0,NULL);
+	j->group = CVectorCreate(sizeof(struct record *),0,NULL);
+	j->deferred = CVectorCreate(sizeof(struct record *),0,NULL);
+	return j;
+}
+
+void
+JournalAppend(Journal *j, const char *name, ExtMap *extents,
+							JournalDoneFn done, void *aux)
+{
+	assert(j);
+	if (j->broken) {
+		done(ErrorReturn,aux);
+		return;
+	}
+	struct record *r = make_record(name,extents);
+	r->j = j;
+	r->done = done;
+	r->aux = aux;
+	if (j->sync_wanted)
+		CVectorAppend(j->deferred,&r);
+	else
+		submit_record(j,r);
+}
+
+bool
+JournalFull(Journal *j)
+{
+	assert(j);
+	return j->broken || j->end >= JOURNAL_CHECKPOINT_BYTES;
+}
+
+bool
+JournalIdle(Journal *j)
+{
+	assert(j);
+	return j->writing == 0 && !j->syncing && CVectorCount(j->landed) == 0 &&
+				 CVectorCount(j->deferred) == 0;
+}
+
+int
+JournalCheckpoint(Journal *j)
+{
+	assert(j && JournalIdle(j));
+	if (syncfs(j->fd) < 0) {
+		perror("unable to sync the files");
+		return ErrorReturn;
+	}
+	if (ftruncate(j->fd,0) < 0 || fsync(j->fd) < 0) {
+		perror("unable to empty the journal");
+		return ErrorReturn;
+	}
+	printf("journal checkpointed at %ld bytes\n",(long) j->end);
+	j->end = 0;
+	j->broken = false;
+	return NormalReturn;
+}
+
+/* 
+ * Whether a record whose CRC holds names a file of the mount directory 
+ * and its extents lie within it. Only a bug or a forged record fails this.
+ */
+static bool
+valid_record(struct record_header *h)
+{
+	if (memchr(h->name,'\0',JOURNAL_NAME_LEN) == NULL || strchr(h->name,'/') ||
+			!strcmp(h->name,"") || !strcmp(h->name,".") || !strcmp(h->name,".."))
+		return false;
+	char *p = (char *) h + sizeof(*h), *end = (char *) h + h->len;
+	for (uint32_t i=0; i<h->nextents; i++) {
+		struct record_extent re;
+		if (p + sizeof(re) > end)
+			return false;
+		memcpy(&re,p,sizeof(re));
+		p += sizeof(re);
+		if (re.len < 0 || re.offset < 0 || re.len > end - p)
+			return false;
+		p += re.len;
+	}
+	return true;
+}
+
+/* writes one valid record's extents into its file */
+static int
+replay_record(const char *dir, struct record_header *h)
+{
+	char path[JOURNAL_PATH_LEN];
+	snprintf(path,sizeof(path),"%s%s",dir,h->name);
+	int fd = open(path,O_WRONLY | O_CREAT,S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		perror("unable to open a journaled file");
+		return ErrorReturn;
+	}
+
+	char *p = (char *) h + sizeof(*h);
+	int success = NormalReturn;
+	for (uint32_t i=0; i<h->nextents && success == NormalReturn; i++) {
+		struct record_extent re;
+		memcpy(&re,p,sizeof(re));
+		p += sizeof(re);
+		for (int done = 0; done < re.len; ) {
+			ssize_t n = pwrite(fd,p + done,re.len - done,re.offset + done);
+			if (n < 0 && errno != EINTR) {
+				perror("unable to replay the journal");
+				success = ErrorReturn;
+				break;
+			}
+			if (n > 0)
+				done += n;
+		}
+		p += re.len;
+	}
+	close(fd);
+	return success;
+}
+
+int
+JournalRecover(const char *dir)
+{
+	char path[JOURNAL_PATH_LEN];
+	journal_path(dir,path);
+	int fd = open(path,O_RDWR);
+	if (fd < 0)
+		return errno == ENOENT ? NormalReturn : ErrorReturn;
+	struct stat st;
+	if (fstat(fd,&st) < 0 || st.st_size == 0) {
+		close(fd);
+		return NormalReturn;
+	}
+
+	char *buf = malloc(st.st_size);
+	assert(buf);
+	off_t size = 0;
+	while (size < st.st_size) {
+		ssize_t n = pread(fd,buf + size,st.st_size - size,size);
+		if (n <= 0)
+			break;
+		size += n;
+	}
+
+	/* the first torn or missing record ends the journal, none after it was acked */
+	int success = NormalReturn, nrecords = 0;
+	off_t pos = 0;
+	size_t from = offsetof(struct record_header,len);
+	while (pos + (off_t) sizeof(struct record_header) <= size) {
+		struct record_header *h = (struct record_header *) (buf + pos);
+		if (h->magic != JOURNAL_MAGIC || h->len < sizeof(*h) ||
+				h->len > size - pos ||
+				crc32c(0,(char *) h + from,h->len - from) != h->crc)
+			break;
+		/* one bad record must not keep the server down, it is left out */
+		if (!valid_record(h)) {
+			fprintf(stderr,"skipping a malformed journal record at %ld\n",
+							(long) pos);
+			pos += h->len;
+			continue;
+		}
+		if ((success = replay_record(dir,h)) != NormalReturn)
+			break;
+		pos += h->len;
+		nrecords++;
+	}
+	free(buf);
+
+	if (success == NormalReturn &&
+			(syncfs(fd) < 0 || ftruncate(fd,0) < 0 || fsync(fd) < 0)) {
+		perror("unable to empty the journal");
+		success = ErrorReturn;
+	}
+	close(fd);
+	if (success == NormalReturn)
+		success = sync_dir(dir);
+	printf("replayed %d journal record(s)\n",nrecords);
+	return success;
+}
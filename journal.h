@@ -0,0 +1,53 @@
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdbool.h>
+#include "net.h"
+#include "disk.h"
+#include "extmap.h"
+
+/*
+ * Append-only journal of committed extents, in the mount directory. A
+ * commit is durable, and may be acknowledged, once its record is written
+ * and an fdatasync covering it has completed. Records that land within
+ * JOURNAL_WINDOW_US of the first one of a group share that sync. The
+ * files themselves are brought up to date afterwards, and a checkpoint
+ * empties the journal once every record in it has been applied.
+ *
+ * Runs on the disk thread, through its Disk and event loop.
+ */
+#define JOURNAL_NAME ".replfs-journal"
+#define JOURNAL_NAME_LEN 128
+#define JOURNAL_WINDOW_US 500
+#define JOURNAL_CHECKPOINT_BYTES (16 * 1024 * 1024)
+
+typedef struct journal Journal;
+
+/* result is NormalReturn once the record is on disk */
+typedef void (*JournalDoneFn)(int result, void *aux);
+
+/*
+ * Replays every intact record of dir's journal into its file, syncs the
+ * files and empties the journal. Runs before the server starts.
+ */
+int JournalRecover(const char *dir);
+
+Journal *JournalOpen(const char *dir, Disk *disk, struct net_loop *loop);
+
+/* records the extents of a commit to name, relative to the mount directory */
+void JournalAppend(Journal *j, const char *name, ExtMap *extents,
+									 JournalDoneFn done, void *aux);
+
+/* grown past JOURNAL_CHECKPOINT_BYTES, new commits should wait for a checkpoint */
+bool JournalFull(Journal *j);
+
+/* no record on its way to disk */
+bool JournalIdle(Journal *j);
+
+/*
+ * Once every record has been applied and the journal is idle: syncs the
+ * file system the files share with the journal, then empties it.
+ */
+int JournalCheckpoint(Journal *j);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE		/* recvmmsg(), sendmmsg() */
 #include <sys/types.h> 
 #include <sys/socket.h> /* for socket(), connect(), send(), and recv() */
 #include <arpa/inet.h>  /* for sockaddr_in and inet_addr() */
@@ -18,22 +19,66 @@
 #include <sys/time.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include "utils.h"
 
 
 #define MULTICAST_GROUP	 0xe0010101
 
-struct ip_mreq
-{
-    struct in_addr imr_multiaddr; /* IPv4 Class D multicast address */
-    struct in_addr imr_interface; /* IPv4 address of local interface */
+#define SEND_SLOTS 64
+#define LOOP_SOURCES 16
+
+struct net_ring {
+	int slots;
+	int head;			/* next datagram handed out by netRingNext */
+	int count;		/* datagrams held from the last netRecvBatch */
+	char *bufs;
+	size_t *lens;
+	struct sockaddr_in *senders;
+	struct mmsghdr *hdrs;
+	struct iovec *iovs;
+};
+
+struct net_source {
+	int fd;
+	NetEventFn fn;
+	void *aux;
+	bool timer;		/* a timerfd, its expirations are read before fn runs */
+};
+
+/* sockets and timerfds on one epoll set */
+struct net_loop {
+	int epfd;
+	int nsources;
+	struct net_source sources[LOOP_SOURCES];
 };
 
 int sid;
 struct ip_mreq mreq;  
-struct sockaddr_in sdest;
+__thread struct sockaddr_in sdest;	/* the group netSend() goes to, per thread */
+unsigned short port;
 int packetLoss;
 
+/* netRecvBatch() waits on its own loop: the socket and a deadline timer */
+struct net_loop *recv_loop;
+int recv_timer;
+bool recv_expired;
+
+static void wake(void *aux);
+static void expire(void *aux);
+
+/* 
+ * Outgoing datagrams queued while corked, corks nest. Each thread has its 
+ * own queue, so threads can send on the shared socket without locking.
+ */
+__thread int corked;
+__thread int nqueued;
+__thread char sendbufs[SEND_SLOTS][BUFFER_SIZE];
+__thread struct sockaddr_in senddests[SEND_SLOTS];
+__thread struct iovec sendiovs[SEND_SLOTS];
+__thread struct mmsghdr sendhdrs[SEND_SLOTS];
+
 
 int
 netInit(unsigned short portNum, int packetLoss_)
@@ -53,9 +98,8 @@ netInit(unsigned short portNum, int packetLoss_)
 		shost.sin_port = htons(portNum);
 		shost.sin_addr.s_addr = htonl(INADDR_ANY); 
 
-		sdest.sin_family = AF_INET;
-		sdest.sin_port = htons(portNum);
-		sdest.sin_addr.s_addr = htonl(MULTICAST_GROUP); 
+		port = portNum;
+		netSetGroup(0);
 
 
 		/** bind the UDP socket to the mcast address to recv messages 
@@ -82,8 +126,18 @@ netInit(unsigned short portNum, int packetLoss_)
 		if ( setsockopt(sid,IPPROTO_IP,IP_ADD_MEMBERSHIP,(char *) &mreq,
 			  sizeof(mreq)) == -1 ) ERROR("unable to join group");
 
+#ifdef IP_MULTICAST_ALL
+		/* only the groups this socket joined, not every one the host has */
+		int all = 0;
+		if ( setsockopt(sid,IPPROTO_IP,IP_MULTICAST_ALL,&all,
+			  sizeof(int)) == -1 ) ERROR("unable to filter groups");
+#endif
+
 
-		/* set file descriptor mask for select statement */
+		recv_loop = netLoopCreate();
+		if (netLoopAdd(recv_loop,sid,wake,NULL) < 0 ||
+				(recv_timer = netTimerCreate(recv_loop,expire,&recv_expired)) < 0)
+			ERROR("unable to set up the event loop");
 
 		return 0;
  }
@@ -97,62 +151,373 @@ netClose()
                 (char *) &mreq,sizeof(mreq)) == -1 ) 
   								ERROR("unable to leave group");
 
+  netLoopDispose(recv_loop);
   close(sid);
 	return 0;
 }
 
 
+static int
+set_membership(uint32_t group, int option)
+{
+	struct ip_mreq req;
+	req.imr_multiaddr.s_addr = htonl(group);
+	req.imr_interface.s_addr = htonl(INADDR_ANY);
+	return setsockopt(sid,IPPROTO_IP,option,(char *) &req,sizeof(req));
+}
+
+int netJoin(uint32_t group)
+{
+	if (set_membership(group,IP_ADD_MEMBERSHIP) == -1)
+		ERROR("unable to join group");
+	return 0;
+}
+
+int netLeave(uint32_t group)
+{
+	if (set_membership(group,IP_DROP_MEMBERSHIP) == -1)
+		ERROR("unable to leave group");
+	return 0;
+}
+
+void netSetGroup(uint32_t group)
+{
+	sdest.sin_family = AF_INET;
+	sdest.sin_port = htons(port);
+	sdest.sin_addr.s_addr = htonl(group ? group : MULTICAST_GROUP);
+}
+
+static int flush_queue();
+
 int netSend(void *buf, size_t n)
 {
-	
-	return sendto(sid, buf, n, 0, (struct sockaddr *) &sdest, 
-							sizeof(struct sockaddr));
+	return netSendTo(buf,n,NULL);
+}
 
+int netSendv(struct iovec *iov, int iovcnt)
+{
+	return netSendvTo(iov,iovcnt,NULL);
+}
 
+int netSendTo(void *buf, size_t n, struct sockaddr_in *dest)
+{
+	struct iovec iov;
+	iov.iov_base = buf;
+	iov.iov_len = n;
+	return netSendvTo(&iov,1,dest);
 }
 
-#define MAX
-size_t netRecv(void *buf, size_t n, struct sockaddr_in *sender, 
-							 struct timeval deadline)
+/* 
+ * Gathers the segments straight from the caller's buffers with sendmsg(),
+ * to dest or, when it is NULL, to the group.
+ */
+int netSendvTo(struct iovec *iov, int iovcnt, struct sockaddr_in *dest)
 {
+	if (!dest) {
+		if (!sdest.sin_family)
+			netSetGroup(0);
+		dest = &sdest;
+	}
 
-	socklen_t slen = sizeof(struct sockaddr);
-	ssize_t msglen = 0;
+	size_t n = 0;
+	for (int i=0; i<iovcnt; i++)
+		n += iov[i].iov_len;
+
+	if (corked && n <= BUFFER_SIZE) {
+		if (nqueued == SEND_SLOTS)
+			flush_queue();
+		char *dst = sendbufs[nqueued];
+		for (int i=0; i<iovcnt; i++) {
+			memcpy(dst,iov[i].iov_base,iov[i].iov_len);
+			dst += iov[i].iov_len;
+		}
+		sendiovs[nqueued].iov_base = sendbufs[nqueued];
+		sendiovs[nqueued].iov_len = n;
+		senddests[nqueued] = *dest;
+		nqueued++;
+		return n;
+	}
 
-	struct timeval tstart;
-	gettimeofday(&tstart,NULL);
-	struct timeval to_wait = time_diff(deadline,tstart);
+	struct msghdr mh;
+	memset(&mh,0,sizeof(mh));
+	mh.msg_name = dest;
+	mh.msg_namelen = sizeof(struct sockaddr_in);
+	mh.msg_iov = iov;
+	mh.msg_iovlen = iovcnt;
+	return sendmsg(sid, &mh, 0);
+}
 
-	fd_set fdmask;
-	FD_ZERO(&fdmask);
-	FD_SET(sid, &fdmask);
+static int flush_queue()
+{
+	for (int i=0; i<nqueued; i++) {
+		memset(&sendhdrs[i],0,sizeof(struct mmsghdr));
+		sendhdrs[i].msg_hdr.msg_name = &senddests[i];
+		sendhdrs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		sendhdrs[i].msg_hdr.msg_iov = &sendiovs[i];
+		sendhdrs[i].msg_hdr.msg_iovlen = 1;
+	}
 
-	while (true) {
-		if (select(sid+1,&fdmask,NULL,NULL,&to_wait) > 0) {
-			int r = rand() %100;
-
-			struct sockaddr_in s;
-			int templen = recvfrom(sid, buf,n, 0,(struct sockaddr *)&s,&slen);
-			char str_addr[INET_ADDRSTRLEN];
-			*str_addr = '\0';
-			inet_ntop(AF_INET, &(s.sin_addr), str_addr, INET_ADDRSTRLEN);
-			printf("received [%d] bytes from [%s]\n",templen, str_addr);
-			if (r > packetLoss && valid_msg(buf)) {
-				msglen = templen;
-				if (sender) memcpy(sender, &s, sizeof(struct sockaddr_in));
-				break;
+	int sent = 0;
+	while (sent < nqueued) {
+		int r = sendmmsg(sid, sendhdrs + sent, nqueued - sent, 0);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			perror("sendmmsg");
+			break;
+		}
+		sent += r;
+	}
+	nqueued = 0;
+	return sent;
+}
+
+void netCork()
+{
+	corked++;
+}
+
+int netUncork()
+{
+	if (corked > 0 && --corked > 0)
+		return 0;
+	return flush_queue();
+}
+
+struct net_ring *
+netRingCreate(int slots)
+{
+	assert(slots > 0);
+	struct net_ring *ring = malloc(sizeof(struct net_ring));
+	assert(ring);
+	ring->slots = slots;
+	ring->head = 0;
+	ring->count = 0;
+	ring->bufs = malloc(slots * BUFFER_SIZE);
+	ring->lens = malloc(slots * sizeof(size_t));
+	ring->senders = malloc(slots * sizeof(struct sockaddr_in));
+	ring->hdrs = malloc(slots * sizeof(struct mmsghdr));
+	ring->iovs = malloc(slots * sizeof(struct iovec));
+	assert(ring->bufs && ring->lens && ring->senders && ring->hdrs && ring->iovs);
+	return ring;
+}
+
+void
+netRingDispose(struct net_ring *ring)
+{
+	assert(ring);
+	free(ring->bufs);
+	free(ring->lens);
+	free(ring->senders);
+	free(ring->hdrs);
+	free(ring->iovs);
+	free(ring);
+}
+
+/* 
+ * Drains up to ring->slots datagrams with a single non-blocking recvmmsg().
+ * Dropped and corrupt datagrams are compacted out. Returns the number of 
+ * datagrams held.
+ */
+int netRecvReady(struct net_ring *ring)
+{
+	ring->head = 0;
+	ring->count = 0;
+
+	for (int i=0; i<ring->slots; i++) {
+		ring->iovs[i].iov_base = ring->bufs + i*BUFFER_SIZE;
+		ring->iovs[i].iov_len = BUFFER_SIZE;
+		memset(&ring->hdrs[i],0,sizeof(struct mmsghdr));
+		ring->hdrs[i].msg_hdr.msg_name = &ring->senders[i];
+		ring->hdrs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		ring->hdrs[i].msg_hdr.msg_iov = &ring->iovs[i];
+		ring->hdrs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int n = recvmmsg(sid, ring->hdrs, ring->slots, MSG_DONTWAIT, NULL);
+	if (n <= 0)
+		return 0;
+	printf("received [%d] datagrams\n",n);
+
+	for (int i=0; i<n; i++) {
+		char *buf = ring->bufs + i*BUFFER_SIZE;
+		struct replfs_msg *msg = (struct replfs_msg *) buf;
+		int r = rand() %100;
+		if (r > packetLoss && ring->hdrs[i].msg_len >= sizeof(*msg) &&
+				msg->len <= ring->hdrs[i].msg_len && valid_msg(msg)) {
+			if (i != ring->count) {
+				memcpy(ring->bufs + ring->count*BUFFER_SIZE, buf, 
+							 ring->hdrs[i].msg_len);
+				ring->senders[ring->count] = ring->senders[i];
 			}
-			printf("dropping on floor...\n");
+			ring->lens[ring->count++] = ring->hdrs[i].msg_len;
 		} else {
-			break;
+			printf("dropping on floor...\n");
+		}
+	}
+	return ring->count;
+}
+
+static void
+wake(void *aux)
+{
+}
+
+static void
+expire(void *aux)
+{
+	*(bool *) aux = true;
+}
+
+/* 
+ * Waits on the event loop until datagrams arrive or the deadline passes,
+ * then drains them with netRecvReady(). A deadline already passed still 
+ * polls what is queued.
+ */
+int netRecvBatch(struct net_ring *ring, struct timeval deadline)
+{
+	recv_expired = false;
+	netTimerArm(recv_timer,deadline);
+	while (true) {
+		int n = netRecvReady(ring);
+		if (n > 0 || recv_expired) {
+			netTimerDisarm(recv_timer);
+			return n;
 		}
+		netLoopOnce(recv_loop);
 	}
+}
+
+struct net_loop *
+netLoopCreate()
+{
+	struct net_loop *loop = malloc(sizeof(struct net_loop));
+	assert(loop);
+	loop->epfd = epoll_create1(0);
+	assert(loop->epfd >= 0);
+	loop->nsources = 0;
+	return loop;
+}
+
+void
+netLoopDispose(struct net_loop *loop)
+{
+	assert(loop);
+	for (int i=0; i<loop->nsources; i++)
+		if (loop->sources[i].timer)
+			close(loop->sources[i].fd);
+	close(loop->epfd);
+	free(loop);
+}
 
-	return msglen;
+static int
+add_source(struct net_loop *loop, int fd, NetEventFn fn, void *aux, 
+					 bool timer)
+{
+	if (loop->nsources == LOOP_SOURCES)
+		ERROR("too many event sources");
+	struct net_source *src = &loop->sources[loop->nsources];
+	src->fd = fd;
+	src->fn = fn;
+	src->aux = aux;
+	src->timer = timer;
+
+	struct epoll_event ev;
+	memset(&ev,0,sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = src;
+	if (epoll_ctl(loop->epfd,EPOLL_CTL_ADD,fd,&ev) == -1)
+		ERROR("unable to watch fd");
+	loop->nsources++;
+	return fd;
 }
 
+int
+netLoopAdd(struct net_loop *loop, int fd, NetEventFn fn, void *aux)
+{
+	assert(loop);
+	return add_source(loop,fd,fn,aux,false);
+}
 
+int
+netTimerCreate(struct net_loop *loop, NetEventFn fn, void *aux)
+{
+	assert(loop);
+	int tfd = timerfd_create(CLOCK_REALTIME,TFD_NONBLOCK);
+	if (tfd < 0)
+		ERROR("unable to create timer");
+	if (add_source(loop,tfd,fn,aux,true) < 0) {
+		close(tfd);
+		return -1;
+	}
+	return tfd;
+}
+
+/* deadlines are gettimeofday() times, so the timer runs on CLOCK_REALTIME */
+int
+netTimerArm(int timer, struct timeval deadline)
+{
+	/* an expiry nobody read must not fire the new deadline */
+	uint64_t expirations;
+	while (read(timer,&expirations,sizeof(expirations)) > 0)
+		;
+
+	struct itimerspec its;
+	memset(&its,0,sizeof(its));
+	its.it_value.tv_sec = deadline.tv_sec;
+	its.it_value.tv_nsec = deadline.tv_usec * 1000;
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1;		/* zero would disarm */
+	return timerfd_settime(timer,TFD_TIMER_ABSTIME,&its,NULL);
+}
 
+int
+netTimerDisarm(int timer)
+{
+	struct itimerspec its;
+	memset(&its,0,sizeof(its));
+	return timerfd_settime(timer,0,&its,NULL);
+}
 
+/* 
+ * Waits for at least one fd to become readable or timer to fire, and calls
+ * their handlers. Sockets are level triggered: a handler that leaves 
+ * datagrams queued is called again on the next round.
+ */
+int
+netLoopOnce(struct net_loop *loop)
+{
+	struct epoll_event events[LOOP_SOURCES];
+	int n = epoll_wait(loop->epfd,events,LOOP_SOURCES,-1);
+	if (n < 0) {
+		if (errno != EINTR)
+			perror("epoll_wait");
+		return n;
+	}
+	for (int i=0; i<n; i++) {
+		struct net_source *src = events[i].data.ptr;
+		if (src->timer) {
+			uint64_t expirations;
+			if (read(src->fd,&expirations,sizeof(expirations)) <= 0)
+				continue;
+		}
+		src->fn(src->aux);
+	}
+	return n;
+}
 
+int
+netSocket()
+{
+	return sid;
+}
 
+void *netRingNext(struct net_ring *ring, size_t *len, 
+									struct sockaddr_in *sender)
+{
+	if (ring->head >= ring->count)
+		return NULL;
+	int i = ring->head++;
+	if (len) *len = ring->lens[i];
+	if (sender) memcpy(sender, &ring->senders[i], sizeof(struct sockaddr_in));
+	return ring->bufs + i*BUFFER_SIZE;
+}
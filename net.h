@@ -1,10 +1,65 @@
+#ifndef __NET_H__
+#define __NET_H__
+
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <stdint.h>
+
+/* ring of datagram buffers filled by a single recvmmsg() */
+struct net_ring;
 
 int netInit(unsigned short portNum, int packetLoss_);
 int netSend(void *buf, size_t n);
-size_t netRecv(void *buf, size_t n, struct sockaddr_in *sender, 
-							 struct timeval deadline);
+int netSendv(struct iovec *iov, int iovcnt);
+
+/* unicast to dest, netSend() and netSendv() go to the group */
+int netSendTo(void *buf, size_t n, struct sockaddr_in *dest);
+int netSendvTo(struct iovec *iov, int iovcnt, struct sockaddr_in *dest);
 int netClose();
+
+/* 
+ * Groups beyond the one netInit() joins. netSetGroup() picks the group
+ * the calling thread's netSend() and netSendv() go to, 0 for netInit()'s.
+ */
+int netJoin(uint32_t group);
+int netLeave(uint32_t group);
+void netSetGroup(uint32_t group);
+
+/* 
+ * While corked, netSend() queues and the outermost netUncork() flushes 
+ * the queue with sendmmsg().
+ */
+void netCork();
+int netUncork();
+
+struct net_ring *netRingCreate(int slots);
+void netRingDispose(struct net_ring *ring);
+int netRecvBatch(struct net_ring *ring, struct timeval deadline);
+int netRecvReady(struct net_ring *ring);
+void *netRingNext(struct net_ring *ring, size_t *len,
+									struct sockaddr_in *sender);
+
+/* 
+ * Event loop on epoll. Sockets and timerfd-backed timers plug in with a 
+ * handler that runs when the fd becomes readable or the timer fires.
+ */
+struct net_loop;
+typedef void (*NetEventFn)(void *aux);
+
+struct net_loop *netLoopCreate();
+void netLoopDispose(struct net_loop *loop);
+int netLoopAdd(struct net_loop *loop, int fd, NetEventFn fn, void *aux);
+int netLoopOnce(struct net_loop *loop);
+
+/* one-shot timers at an absolute gettimeofday() deadline */
+int netTimerCreate(struct net_loop *loop, NetEventFn fn, void *aux);
+int netTimerArm(int timer, struct timeval deadline);
+int netTimerDisarm(int timer);
+
+/* the socket netInit() opened, for other loops to watch */
+int netSocket();
+
+#endif
@@ -1,9 +1,12 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <assert.h>
 
 #include "net.h"
 #include "protocol.h"
+#include "utils.h"
+#include "crc32c.h"
 
 #define DEBUG
 
@@ -13,17 +16,44 @@
 #define DEBUG_PROTOCOL(x) do{} while(0)
 #endif
 
+/* 
+ * Per-thread scratch buffer for outgoing messages. netSend() either puts the
+ * message on the wire or copies it into its queue before returning, so one 
+ * buffer per thread is enough and no sender has to allocate.
+ */
+static __thread union {
+	struct replfs_msg hdr;
+	char buf[BUFFER_SIZE];
+} scratch;
+
+static struct replfs_msg *
+scratch_msg(size_t len)
+{
+	assert(len <= BUFFER_SIZE);
+	memset(&scratch.hdr,0,sizeof(struct replfs_msg));
+	return &scratch.hdr;
+}
+
+/* CRC32C of the whole message, with the checksum field taken as zero */
 int checksum(struct replfs_msg *msg)
 {
 	int cksum = msg->cksum;		
 	msg->cksum = 0;	//exclude checksum field
-  char *ptr = (char *)msg;
-  int sum = 0;
-  for (size_t i=0; i < msg->len; i++) {
-    sum += ptr[i];
-  }
-  msg->cksum = cksum;	
-  return sum;
+	uint32_t crc = crc32c(0,msg,msg->len);
+	msg->cksum = cksum;	
+	return (int) crc;
+}
+
+/* 
+ * Same checksum over a message split across segments. The first segment 
+ * holds the replfs_msg header, whose cksum field must be zero.
+ */
+int checksum_iov(struct iovec *iov, int iovcnt)
+{
+	uint32_t crc = 0;
+	for (int i=0; i < iovcnt; i++)
+		crc = crc32c(crc,iov[i].iov_base,iov[i].iov_len);
+	return (int) crc;
 }
 
 
@@ -39,6 +69,44 @@ get_payload(struct replfs_msg *msg)
 	return (((char *)msg) + sizeof(struct replfs_msg));
 }
 
+uint32_t
+file_group(const char *filename)
+{
+	return FILE_GROUP_BASE + crc32c(0,filename,strlen(filename)) % FILE_GROUPS;
+}
+
+int
+msg_fd(struct replfs_msg *msg)
+{
+	size_t at;
+	switch (msg->msg_type) {
+		case MsgOpen:
+			at = offsetof(struct replfs_msg_open_long,fd);
+			break;
+		case MsgWriteBatch:
+			/* the first block's, a batch is all one file's */
+			at = sizeof(int) + offsetof(struct write_block,fd);
+			break;
+		case MsgClose:
+		case MsgWrite:
+		case MsgTryCommit:
+		case MsgCommit:
+		case MsgAbort:
+		case MsgWriteFrag:
+		case MsgNack:
+		case MsgWriteParity:
+			at = 0;
+			break;
+		default:
+			return -1;
+	}
+	int fd;
+	if (sizeof(struct replfs_msg) + at + sizeof(fd) > msg->len)
+		return -1;
+	memcpy(&fd,(char *) get_payload(msg) + at,sizeof(fd));
+	return fd;
+}
+
 void 
 send_discover()
 {
@@ -51,14 +119,14 @@ send_discover()
 }
 
 
-void send_discover_ack()
+void send_discover_ack(struct sockaddr_in *to)
 {
 	struct replfs_msg msg;
 	msg.msg_type = MsgDiscoverAck;
 	msg.len = sizeof(struct replfs_msg);
 	msg.cksum = checksum(&msg);
 	//printf("sending discover ack.\n");
-	netSend(&msg,msg.len);
+	netSendTo(&msg,msg.len,to);
 }
 
 
@@ -72,7 +140,7 @@ send_open(char *filename, int fd)
 
 	int len = sizeof(struct replfs_msg) + sizeof(struct replfs_msg_open_long); 
 
-	msg = (struct replfs_msg *) malloc(len);
+	msg = scratch_msg(len);
 	msg->msg_type = MsgOpen;
 	msg->len = len;
 
@@ -83,19 +151,18 @@ send_open(char *filename, int fd)
 	msg->cksum = checksum(msg);
 	//printf("sending open.\n");
 	netSend(msg,msg->len);
-	free(msg);
 }
 
 
 void
-send_generic_fd(int fd, enum msg_type_t msg_type)
+send_generic_fd(int fd, enum msg_type_t msg_type, struct sockaddr_in *to)
 {
 	struct replfs_msg *msg;
 	struct replfs_msg_open *payload;
 
 	int len = sizeof(struct replfs_msg) + sizeof(struct replfs_msg_open); 
 
-	msg = (struct replfs_msg *) malloc(len);
+	msg = scratch_msg(len);
 	msg->msg_type = msg_type;
 	msg->len = len;
 
@@ -104,79 +171,269 @@ send_generic_fd(int fd, enum msg_type_t msg_type)
 
 	msg->cksum = checksum(msg);
 	//printf("sending open ack.\n");
-	netSend(msg,msg->len);
-	free(msg);
+	netSendTo(msg,msg->len,to);
 }
 
 void
-send_open_fail(int fd)
+send_open_fail(int fd, struct sockaddr_in *to)
 {
-	send_generic_fd(fd, MsgOpenFail);
+	send_generic_fd(fd, MsgOpenFail, to);
 }
 
 
 void
-send_open_success(int fd)
+send_open_success(int fd, struct sockaddr_in *to)
 {
-	send_generic_fd(fd, MsgOpenSuccess);
+	send_generic_fd(fd, MsgOpenSuccess, to);
 }
 
 void
 send_close(int fd)
 {
 	DEBUG_PROTOCOL("sending close");
-	send_generic_fd(fd, MsgClose);
+	send_generic_fd(fd, MsgClose, NULL);
 }
 
 void 
-send_close_fail(int fd)
+send_close_fail(int fd, struct sockaddr_in *to)
 {
 	DEBUG_PROTOCOL("sending close fail");
-	send_generic_fd(fd, MsgCloseFail);
+	send_generic_fd(fd, MsgCloseFail, to);
 }
 
 void 
-send_close_success(int fd)
+send_close_success(int fd, struct sockaddr_in *to)
 {
 	DEBUG_PROTOCOL("sending close success");
-	send_generic_fd(fd, MsgCloseSuccess);
+	send_generic_fd(fd, MsgCloseSuccess, to);
+}
+
+#define FRAG_DATA_LEN (BUFFER_SIZE - sizeof(struct replfs_msg) - \
+											 sizeof(struct replfs_msg_frag))
+
+int
+frag_count(int len)
+{
+	return (len + FRAG_DATA_LEN - 1) / FRAG_DATA_LEN;
+}
+
+int
+frag_offset(int frag)
+{
+	return frag * FRAG_DATA_LEN;
+}
+
+int
+frag_len(int len, int frag)
+{
+	int left = len - frag_offset(frag);
+	return left < FRAG_DATA_LEN ? left : FRAG_DATA_LEN;
 }
 
+void
+send_write_frag(struct write_block *wb, int frag)
+{
+	struct replfs_msg msg;
+	struct replfs_msg_frag payload;
+
+	int len = frag_len(wb->len,frag);
+
+	memset(&msg,0,sizeof(struct replfs_msg));
+	msg.msg_type = MsgWriteFrag;
+	msg.len = sizeof(struct replfs_msg) + sizeof(struct replfs_msg_frag) + len;
+
+	memset(&payload,0,sizeof(struct replfs_msg_frag));
+	payload.wb = *wb;
+	payload.wb.data = NULL;
+	payload.frag = frag;
+
+	struct iovec iov[3];
+	iov[0].iov_base = &msg;
+	iov[0].iov_len = sizeof(struct replfs_msg);
+	iov[1].iov_base = &payload;
+	iov[1].iov_len = sizeof(struct replfs_msg_frag);
+	iov[2].iov_base = wb->data + frag_offset(frag);
+	iov[2].iov_len = len;
+
+	msg.cksum = checksum_iov(iov,3);
+	netSendv(iov,3);
+}
+
+/* blocks that don't fit in one datagram go out as MsgWriteFrag fragments */
 void
 send_write(struct write_block *wb)
 {
+	if (sizeof(struct replfs_msg) + sizeof(struct write_block) + wb->len >
+			BUFFER_SIZE) {
+		DEBUG_PROTOCOL("sending fragmented write");
+		netCork();
+		for (int frag=0; frag<frag_count(wb->len); frag++)
+			send_write_frag(wb,frag);
+		netUncork();
+		return;
+	}
+
 	DEBUG_PROTOCOL("sending write");
-	struct replfs_msg *msg;
-	struct write_block *payload;
+	struct replfs_msg msg;
+	struct write_block payload;
 
-	int len = sizeof(struct replfs_msg) + sizeof(struct write_block) + wb->len; 
-	// msg = (struct replfs_msg *) malloc(len);
-	msg = malloc(len);
-	msg->msg_type = MsgWrite;
-	msg->len = len;
+	memset(&msg,0,sizeof(struct replfs_msg));
+	msg.msg_type = MsgWrite;
+	msg.len = sizeof(struct replfs_msg) + sizeof(struct write_block) + wb->len; 
 
-	payload = (struct write_block *) get_payload(msg);
-	memcpy(payload,wb,sizeof(struct write_block));
-	payload->data = NULL;
+	memcpy(&payload,wb,sizeof(struct write_block));
+	payload.data = NULL;
 
-	void *dataload = ((char *)payload) + sizeof(struct write_block);
-	memcpy(dataload,wb->data,wb->len);
+	/* header, write header and the caller's data go out without a copy */
+	struct iovec iov[3];
+	iov[0].iov_base = &msg;
+	iov[0].iov_len = sizeof(struct replfs_msg);
+	iov[1].iov_base = &payload;
+	iov[1].iov_len = sizeof(struct write_block);
+	iov[2].iov_base = wb->data;
+	iov[2].iov_len = wb->len;
 
-	msg->cksum = checksum(msg);
+	msg.cksum = checksum_iov(iov,3);
 	//printf("sending write.\n");
-	netSend(msg,msg->len);
-	free(msg);
+	netSendv(iov,3);
+}
+
+void
+batch_init(struct write_batch *batch)
+{
+	batch->n = 0;
+	batch->len = sizeof(struct replfs_msg) + sizeof(int);
+}
+
+/* 
+ * Adds a block if it fits in the datagram. The batch keeps a pointer to 
+ * wb->data, which must stay valid until the batch is sent.
+ */
+bool
+batch_add(struct write_batch *batch, struct write_block *wb)
+{
+	size_t len = sizeof(struct write_block) + wb->len;
+	if (batch->n == BATCH_MAX_BLOCKS || batch->len + len > BUFFER_SIZE)
+		return false;
+
+	batch->hdrs[batch->n] = *wb;
+	batch->hdrs[batch->n].data = NULL;
+	batch->data[batch->n] = wb->data;
+	batch->n++;
+	batch->len += len;
+	return true;
 }
 
+/* sends the batch as one datagram, gathered from the blocks, and empties it */
 void
-send_generic_commit(int fd, int from_wid, int to_wid, enum msg_type_t msg_type)
+send_write_batch(struct write_batch *batch)
+{
+	if (batch->n == 0)
+		return;
+	DEBUG_PROTOCOL("sending write batch");
+	struct replfs_msg msg;
+	struct iovec iov[2 + 2*BATCH_MAX_BLOCKS];
+
+	memset(&msg,0,sizeof(struct replfs_msg));
+	msg.msg_type = MsgWriteBatch;
+	msg.len = batch->len;
+
+	iov[0].iov_base = &msg;
+	iov[0].iov_len = sizeof(struct replfs_msg);
+	iov[1].iov_base = &batch->n;
+	iov[1].iov_len = sizeof(int);
+	int iovcnt = 2;
+	for (int i=0; i<batch->n; i++) {
+		iov[iovcnt].iov_base = &batch->hdrs[i];
+		iov[iovcnt++].iov_len = sizeof(struct write_block);
+		iov[iovcnt].iov_base = batch->data[i];
+		iov[iovcnt++].iov_len = batch->hdrs[i].len;
+	}
+
+	msg.cksum = checksum_iov(iov,iovcnt);
+	netSendv(iov,iovcnt);
+	batch_init(batch);
+}
+
+void
+parity_init(struct write_parity *parity)
+{
+	memset(&parity->hdr,0,sizeof(struct replfs_msg_parity));
+}
+
+void
+xor_bytes(char *dst, const char *src, int len)
+{
+	for (int i=0; i<len; i++)
+		dst[i] ^= src[i];
+}
+
+/* 
+ * Folds the next wid of the group into the parity. Fails for a block that
+ * needs more than one datagram or one that does not follow the group.
+ */
+bool
+parity_add(struct write_parity *parity, struct write_block *wb)
+{
+	struct replfs_msg_parity *hdr = &parity->hdr;
+	if (sizeof(struct replfs_msg) + sizeof(struct replfs_msg_parity) + wb->len >
+			BUFFER_SIZE || wb->len > PARITY_MAX_LEN)
+		return false;
+	if (hdr->n > 0 && (wb->fd != hdr->fd || wb->wid != hdr->from_wid + hdr->n))
+		return false;
+
+	if (hdr->n == 0) {
+		hdr->fd = wb->fd;
+		hdr->from_wid = wb->wid;
+	}
+	if (wb->len > hdr->len) {
+		memset(parity->data + hdr->len,0,wb->len - hdr->len);
+		hdr->len = wb->len;
+	}
+	xor_bytes(parity->data,wb->data,wb->len);
+	hdr->offset ^= wb->offset;
+	hdr->len_xor ^= wb->len;
+	hdr->n++;
+	return true;
+}
+
+/* sends the group's parity, if it has any blocks, and empties it */
+void
+send_write_parity(struct write_parity *parity)
+{
+	if (parity->hdr.n == 0)
+		return;
+	DEBUG_PROTOCOL("sending write parity");
+	struct replfs_msg msg;
+	struct iovec iov[3];
+
+	memset(&msg,0,sizeof(struct replfs_msg));
+	msg.msg_type = MsgWriteParity;
+	msg.len = sizeof(struct replfs_msg) + sizeof(struct replfs_msg_parity) + 
+						parity->hdr.len;
+
+	iov[0].iov_base = &msg;
+	iov[0].iov_len = sizeof(struct replfs_msg);
+	iov[1].iov_base = &parity->hdr;
+	iov[1].iov_len = sizeof(struct replfs_msg_parity);
+	iov[2].iov_base = parity->data;
+	iov[2].iov_len = parity->hdr.len;
+
+	msg.cksum = checksum_iov(iov,3);
+	netSendv(iov,3);
+	parity_init(parity);
+}
+
+void
+send_generic_commit(int fd, int from_wid, int to_wid, enum msg_type_t msg_type,
+										struct sockaddr_in *to)
 {
 	struct replfs_msg *msg;
 	struct replfs_msg_commit *msg_commit;
 
 	int len = sizeof(struct replfs_msg) + sizeof(struct replfs_msg_commit); 
 
-	msg = (struct replfs_msg *) malloc(len);
+	msg = scratch_msg(len);
 	msg->msg_type = msg_type;
 	msg->len = len;
 
@@ -187,8 +444,7 @@ send_generic_commit(int fd, int from_wid, int to_wid, enum msg_type_t msg_type)
 
 	msg->cksum = checksum(msg);
 	//printf("sending try commit.\n");
-	netSend(msg,msg->len);
-	free(msg);
+	netSendTo(msg,msg->len,to);
 }
 
 
@@ -197,45 +453,171 @@ void
 send_try_commit(int fd, int from_wid, int to_wid)
 {
 	DEBUG_PROTOCOL("sending try-commit");
-	send_generic_commit(fd,from_wid,to_wid,MsgTryCommit);
+	send_generic_commit(fd,from_wid,to_wid,MsgTryCommit,NULL);
 }
 
 
 
+/* 
+ * Encodes the missing runs as ranges or as a bitmap relative to from_wid,
+ * whichever is smaller, so one datagram describes any gap pattern. The
+ * missing fragments of partly received blocks follow, as many as fit.
+ */
 void
-send_try_commit_fail(int fd, int from_wid, int to_wid,int wids[], int n)
+send_generic_nack(int fd, int from_wid, int to_wid,
+									struct wid_range ranges[], int n,
+									struct frag_range frags[], int nfrags,
+									enum msg_type_t msg_type, struct sockaddr_in *to)
 {
-	DEBUG_PROTOCOL("sending try-commit fail");
 	struct replfs_msg *msg;
-	struct replfs_msg_commit_long *payload;
-
-	int len = sizeof(struct replfs_msg) + 
-						sizeof(struct replfs_msg_commit_long) + n*sizeof(int); 
+	struct replfs_msg_nack *payload;
 
-	msg = (struct replfs_msg *) malloc(len);
-	msg->msg_type = MsgTryCommitFail;
-	msg->len = len;
+	int room = BUFFER_SIZE - sizeof(struct replfs_msg) - 
+						 sizeof(struct replfs_msg_nack);
+	int span = n ? ranges[n-1].to_wid - from_wid + 1 : 0;
+	int range_bytes = n * sizeof(struct wid_range);
+	int bitmap_bytes = (span + 7) / 8;
 
-	payload = (struct replfs_msg_commit_long *) get_payload(msg);
+	msg = scratch_msg(BUFFER_SIZE);
+	payload = (struct replfs_msg_nack *) get_payload(msg);
 	payload->fd = fd;
 	payload->from_wid = from_wid;
 	payload->to_wid = to_wid;
-	payload->n = n;
-
-	void *dataload = ((char *) payload) + sizeof(struct replfs_msg_commit_long);
-	memcpy(dataload,wids,n*sizeof(int));
+	char *dataload = ((char *) payload) + sizeof(struct replfs_msg_nack);
+
+	if (range_bytes <= room && range_bytes <= bitmap_bytes) {
+		payload->encoding = NackRanges;
+		payload->n = n;
+		memcpy(dataload,ranges,range_bytes);
+	} else {
+		if (bitmap_bytes > room) {
+			bitmap_bytes = room;
+			span = room * 8;
+		}
+		unsigned char *bits = (unsigned char *) dataload;
+		memset(bits,0,bitmap_bytes);
+		for (int i=0; i<n; i++)
+			for (int wid=ranges[i].from_wid; wid<=ranges[i].to_wid; wid++) {
+				int bit = wid - from_wid;
+				if (bit >= span)
+					break;
+				bits[bit >> 3] |= 1 << (bit & 7);
+			}
+		payload->encoding = NackBitmap;
+		payload->n = span;
+		range_bytes = bitmap_bytes;
+	}
+
+	int frag_room = (room - range_bytes) / sizeof(struct frag_range);
+	payload->nfrags = nfrags < frag_room ? nfrags : frag_room;
+	memcpy(dataload + range_bytes,frags,
+				 payload->nfrags * sizeof(struct frag_range));
 
+	msg->msg_type = msg_type;
+	msg->len = sizeof(struct replfs_msg) + sizeof(struct replfs_msg_nack) + 
+						 range_bytes + payload->nfrags * sizeof(struct frag_range);
 	msg->cksum = checksum(msg);
-	//printf("sending try commit fail.\n");
-	netSend(msg,msg->len);
-	free(msg);
+	netSendTo(msg,msg->len,to);
+}
+
+void
+send_try_commit_fail(int fd, int from_wid, int to_wid,
+										 struct wid_range ranges[], int n,
+										 struct frag_range frags[], int nfrags,
+										 struct sockaddr_in *to)
+{
+	DEBUG_PROTOCOL("sending try-commit fail");
+	send_generic_nack(fd,from_wid,to_wid,ranges,n,frags,nfrags,
+										MsgTryCommitFail,to);
+}
+
+/* 
+ * Unsolicited, for gaps a server notices while writes stream in. Unlike
+ * replies it goes to the group, so peers can hold back their own.
+ */
+void
+send_nack(int fd, int from_wid, int to_wid,
+					struct wid_range ranges[], int n,
+					struct frag_range frags[], int nfrags)
+{
+	DEBUG_PROTOCOL("sending nack");
+	send_generic_nack(fd,from_wid,to_wid,ranges,n,frags,nfrags,MsgNack,NULL);
+}
+
+/* bytes the wid ranges or bitmap of a nack take, -1 if malformed */
+static int
+nack_wid_bytes(struct replfs_msg *msg)
+{
+	struct replfs_msg_nack *payload = 
+							(struct replfs_msg_nack *) get_payload(msg);
+	int room = msg->len - sizeof(struct replfs_msg) - 
+						 sizeof(struct replfs_msg_nack);
+	if (payload->n < 0 || payload->n > room * 8)
+		return -1;
+	int bytes = payload->encoding == NackRanges ? 
+							payload->n * sizeof(struct wid_range) : (payload->n + 7) / 8;
+	return bytes <= room ? bytes : -1;
+}
+
+/* calls fn on every run of missing wids a MsgTryCommitFail or MsgNack reports */
+void
+nack_ranges(struct replfs_msg *msg, NackRangeFn fn, void *aux)
+{
+	struct replfs_msg_nack *payload = 
+							(struct replfs_msg_nack *) get_payload(msg);
+	void *dataload = ((char *) payload) + sizeof(struct replfs_msg_nack);
+
+	if (nack_wid_bytes(msg) < 0)
+		return;
+
+	if (payload->encoding == NackRanges) {
+		struct wid_range *ranges = dataload;
+		for (int i=0; i<payload->n; i++)
+			fn(ranges[i].from_wid,ranges[i].to_wid,aux);
+		return;
+	}
+
+	unsigned char *bits = dataload;
+	for (int bit=0; bit<payload->n; ) {
+		if (!(bits[bit >> 3] & (1 << (bit & 7)))) {
+			bit++;
+			continue;
+		}
+		int end = bit;
+		while (end + 1 < payload->n && (bits[(end+1) >> 3] & (1 << ((end+1) & 7))))
+			end++;
+		fn(payload->from_wid + bit,payload->from_wid + end,aux);
+		bit = end + 1;
+	}
+}
+
+/* calls fn on every run of missing fragments a nack reports */
+void
+nack_frags(struct replfs_msg *msg, NackFragFn fn, void *aux)
+{
+	struct replfs_msg_nack *payload = 
+							(struct replfs_msg_nack *) get_payload(msg);
+	int wid_bytes = nack_wid_bytes(msg);
+	if (wid_bytes < 0)
+		return;
+
+	char *cur = ((char *) payload) + sizeof(struct replfs_msg_nack) + wid_bytes;
+	char *end = ((char *) msg) + msg->len;
+	for (int i=0; i<payload->nfrags; i++) {
+		if (cur + sizeof(struct frag_range) > end)
+			return;
+		struct frag_range range;
+		memcpy(&range,cur,sizeof(struct frag_range));
+		fn(&range,aux);
+		cur += sizeof(struct frag_range);
+	}
 }
 
 void
-send_try_commit_success(int fd, int from_wid, int to_wid)
+send_try_commit_success(int fd, int from_wid, int to_wid, struct sockaddr_in *to)
 {
 	DEBUG_PROTOCOL("sending try-commit success");
-	send_generic_commit(fd, from_wid, to_wid, MsgTryCommitSuccess);
+	send_generic_commit(fd, from_wid, to_wid, MsgTryCommitSuccess, to);
 
 }
 
@@ -243,28 +625,28 @@ void
 send_commit(int fd, int from_wid, int to_wid)
 {
 	DEBUG_PROTOCOL("sending commit");
-	send_generic_commit(fd, from_wid, to_wid, MsgCommit);
+	send_generic_commit(fd, from_wid, to_wid, MsgCommit, NULL);
 }
 
 void 
-send_commit_success(int fd, int from_wid, int to_wid)
+send_commit_success(int fd, int from_wid, int to_wid, struct sockaddr_in *to)
 {
 DEBUG_PROTOCOL("sending commit success");
-	send_generic_commit(fd, from_wid, to_wid,MsgCommitSuccess);
+	send_generic_commit(fd, from_wid, to_wid, MsgCommitSuccess, to);
 }
 
 void 
-send_commit_fail(int fd, int from_wid, int to_wid)
+send_commit_fail(int fd, int from_wid, int to_wid, struct sockaddr_in *to)
 {
 	DEBUG_PROTOCOL("sending commit fail");
-	send_generic_commit(fd, from_wid, to_wid,MsgCommitFail);
+	send_generic_commit(fd, from_wid, to_wid, MsgCommitFail, to);
 }
 
 void 
 send_abort(int fd, int from_wid, int to_wid)
 {
 	DEBUG_PROTOCOL("sending abort");
-	send_generic_commit(fd, from_wid, to_wid, MsgAbort);
+	send_generic_commit(fd, from_wid, to_wid, MsgAbort, NULL);
 }
 
 int wbcmp(void *a, void * b)
@@ -3,7 +3,10 @@
 #define __PROTOCOL_H__
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
 
 enum msg_type_t {
 	MsgDiscover,
@@ -21,9 +24,30 @@ enum msg_type_t {
 	MsgCommit,
 	MsgCommitFail,
 	MsgCommitSuccess,
-	MsgAbort
+	MsgAbort,
+	MsgWriteBatch,
+	MsgWriteFrag,
+	MsgNack,
+	MsgWriteParity
 };
 
+/* 
+ * Discovery and opens use the group netInit() joins. Everything else for an
+ * open file goes to one of FILE_GROUPS groups its name hashes to, which only
+ * the servers with the file open join, so the kernel filters the rest.
+ */
+#define FILE_GROUP_BASE 0xe0010200
+#define FILE_GROUPS 16
+
+/* largest block WriteBlock() accepts, bigger than a datagram is fragmented */
+#define MAX_WRITE_LEN (64*1024)
+
+/* 
+ * most writes one transaction stages, eight times the 128 the assignment 
+ * allows; a server's log spans no more wids than this 
+ */
+#define MAX_STAGED_WRITES 1024
+
 struct replfs_msg {
 	enum msg_type_t	msg_type;
 	size_t len;
@@ -45,11 +69,37 @@ struct replfs_msg_commit {
 	int to_wid;
 };
 
-struct replfs_msg_commit_long {
+/* inclusive run of wids */
+struct wid_range {
+	int from_wid;
+	int to_wid;
+};
+
+enum nack_encoding_t {
+	NackRanges,
+	NackBitmap
+};
+
+/* inclusive run of missing fragments of a partly received block */
+struct frag_range {
+	int wid;
+	int from_frag;
+	int to_frag;
+};
+
+/* 
+ * MsgTryCommitFail and MsgNack payload, followed by n wid_ranges or by a bitmap in 
+ * which bit i marks from_wid+i as missing. A bitmap too long for one 
+ * datagram covers a prefix of the range and n is the bits it holds.
+ * nfrags frag_ranges come last, for blocks the server holds only part of.
+ */
+struct replfs_msg_nack {
 	int fd;
 	int from_wid;
 	int to_wid;
+	enum nack_encoding_t encoding;
 	int n;
+	int nfrags;
 };
 
 struct write_block {
@@ -60,41 +110,132 @@ struct write_block {
    char *data;
 };
 
+/* MsgWriteFrag payload, followed by the fragment's slice of the data */
+struct replfs_msg_frag {
+	struct write_block wb;		/* the whole block, data is NULL */
+	int frag;
+};
+
+/* most records one MsgWriteBatch datagram carries */
+#define BATCH_MAX_BLOCKS 64
+
+/* 
+ * Small writes coalesced into one MsgWriteBatch datagram. The payload is 
+ * an int count followed by each write_block header and its data. 
+ */
+struct write_batch {
+	int n;
+	size_t len;
+	struct write_block hdrs[BATCH_MAX_BLOCKS];
+	char *data[BATCH_MAX_BLOCKS];
+};
+
+/* MsgWriteParity payload, followed by len bytes of parity */
+struct replfs_msg_parity {
+	int fd;
+	int from_wid;
+	int n;						/* the group is wids from_wid .. from_wid+n-1 */
+	int offset;				/* xor of the blocks' offsets */
+	int len_xor;			/* and of their lengths */
+	int len;					/* the longest block, shorter ones count as zero padded */
+};
+
+/* bound on a block that fits in one datagram, and so on its parity */
+#define PARITY_MAX_LEN 1024
+
+/* 
+ * XOR parity of a group of consecutive writes that each fit in one 
+ * datagram. Any one block of the group can be rebuilt from the others.
+ */
+struct write_parity {
+	struct replfs_msg_parity hdr;
+	char data[PARITY_MAX_LEN];
+};
+
 int checksum(struct replfs_msg *msg);
 
+int checksum_iov(struct iovec *iov, int iovcnt);
+
 void *get_payload(struct replfs_msg *msg);
 
+uint32_t file_group(const char *filename);
+
+/* the fd a request is about, -1 for discovery, replies and short ones */
+int msg_fd(struct replfs_msg *msg);
+
+typedef void (*NackRangeFn)(int from_wid, int to_wid, void *aux);
+
+void nack_ranges(struct replfs_msg *msg, NackRangeFn fn, void *aux);
+
+typedef void (*NackFragFn)(struct frag_range *range, void *aux);
+
+void nack_frags(struct replfs_msg *msg, NackFragFn fn, void *aux);
+
 bool valid_msg(struct replfs_msg *msg);
 
 void send_discover();
 
-void send_discover_ack();
+void send_discover_ack(struct sockaddr_in *to);
 
 void send_open(char *filename, int fd);
 
-void send_open_fail(int fd);
+void send_open_fail(int fd, struct sockaddr_in *to);
 
-void send_open_success(int fd);
+void send_open_success(int fd, struct sockaddr_in *to);
 
 void send_close(int fd);
 
-void send_close_fail(int fd);
+void send_close_fail(int fd, struct sockaddr_in *to);
 
-void send_close_success(int fd);
+void send_close_success(int fd, struct sockaddr_in *to);
 
 void send_write(struct write_block *wb);
 
+int frag_count(int len);
+
+int frag_offset(int frag);
+
+/* bytes of a block of len that fragment frag carries */
+int frag_len(int len, int frag);
+
+void send_write_frag(struct write_block *wb, int frag);
+
+void batch_init(struct write_batch *batch);
+
+bool batch_add(struct write_batch *batch, struct write_block *wb);
+
+void send_write_batch(struct write_batch *batch);
+
+void parity_init(struct write_parity *parity);
+
+bool parity_add(struct write_parity *parity, struct write_block *wb);
+
+void send_write_parity(struct write_parity *parity);
+
+void xor_bytes(char *dst, const char *src, int len);
+
 void send_try_commit(int fd, int from_wid, int to_wid);
 
-void send_try_commit_fail(int fd, int from_wid, int to_wid,int wids[], int n);
+/* replies go back to the sender only, to is its address */
+void send_try_commit_fail(int fd, int from_wid, int to_wid,
+													struct wid_range ranges[], int n,
+													struct frag_range frags[], int nfrags,
+													struct sockaddr_in *to);
+
+void send_try_commit_success(int fd, int from_wid, int to_wid,
+													struct sockaddr_in *to);
 
-void send_try_commit_success(int fd, int from_wid, int to_wid);
+void send_nack(int fd, int from_wid, int to_wid,
+							 struct wid_range ranges[], int n,
+							 struct frag_range frags[], int nfrags);
 
 void send_commit(int fd, int from_wid, int to_wid);
 
-void send_commit_success(int fd, int from_wid, int to_wid);
+void send_commit_success(int fd, int from_wid, int to_wid,
+													struct sockaddr_in *to);
 
-void send_commit_fail(int fd, int from_wid, int to_wid);
+void send_commit_fail(int fd, int from_wid, int to_wid,
+													struct sockaddr_in *to);
 
 void send_abort(int fd, int from_wid, int to_wid);
 
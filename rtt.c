@@ -0,0 +1,47 @@
+#include "rtt.h"
+
+#define MAX_BACKOFF 16
+
+void rtt_init(struct rtt *rtt)
+{
+  rtt->srtt_us = 0;
+  rtt->rttvar_us = 0;
+  rtt->rto_ms = RTO_INITIAL_MS;
+  rtt->backoff = 0;
+}
+
+void rtt_sample(struct rtt *rtt, long sample_us)
+{
+  if (sample_us < 0)
+    return;
+
+  if (rtt->srtt_us == 0) {
+    rtt->srtt_us = sample_us;
+    rtt->rttvar_us = sample_us / 2;
+  } else {
+    long err = sample_us - rtt->srtt_us;
+    rtt->srtt_us += err / 8;
+    rtt->rttvar_us += ((err < 0 ? -err : err) - rtt->rttvar_us) / 4;
+  }
+
+  long rto_ms = (rtt->srtt_us + 4 * rtt->rttvar_us + 999) / 1000;
+  if (rto_ms < RTO_MIN_MS)
+    rto_ms = RTO_MIN_MS;
+  if (rto_ms > RTO_MAX_MS)
+    rto_ms = RTO_MAX_MS;
+  rtt->rto_ms = rto_ms;
+  rtt->backoff = 0;
+}
+
+void rtt_backoff(struct rtt *rtt)
+{
+  if (rtt->backoff < MAX_BACKOFF)
+    rtt->backoff++;
+}
+
+/* the current timeout, backed off, in milliseconds */
+long rtt_timeout(struct rtt *rtt)
+{
+  long rto_ms = rtt->rto_ms << rtt->backoff;
+  return rto_ms < RTO_MAX_MS ? rto_ms : RTO_MAX_MS;
+}
@@ -0,0 +1,28 @@
+#ifndef __RTT_H__
+#define __RTT_H__
+
+#define RTO_MIN_MS      5
+#define RTO_MAX_MS      2000
+#define RTO_INITIAL_MS  1000
+
+/* 
+ * Round trip estimator in the style of Jacobson/Karels: a smoothed RTT and
+ * mean deviation give the retransmit timeout, which doubles on every 
+ * timeout until a fresh sample arrives.
+ */
+struct rtt {
+  long srtt_us;
+  long rttvar_us;
+  long rto_ms;
+  int backoff;
+};
+
+void rtt_init(struct rtt *rtt);
+
+void rtt_sample(struct rtt *rtt, long sample_us);
+
+void rtt_backoff(struct rtt *rtt);
+
+long rtt_timeout(struct rtt *rtt);
+
+#endif
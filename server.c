@@ -11,40 +11,366 @@
 #include <errno.h>
 #include <unistd.h>
 #include <assert.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
 
 #include "net.h"
 #include "utils.h"
 #include "protocol.h"
 #include "cvector.h"
+#include "wlog.h"
+#include "extmap.h"
+#include "disk.h"
+#include "journal.h"
+#include "stage.h"
+#include "cqueue.h"
+#include "cring.h"
+#include "crc32c.h"
 
 
 
 #define MAX_ARG_LEN 100
 #define DEFAULT_PORT 41056
-#define MAX_IDLE_TIME 24*60
 #define MAX_FILE_LEN 128
+#define NACK_DELAY_MS 2			/* before a first NACK */
+#define NACK_INTERVAL_MS 20		/* before it is repeated, doubling each time */
+#define NACK_MAX_TRIES 8			/* for gaps the client leaves unfilled */
+#define NACK_SPREAD_MS 8			/* random extra delay, as in SRM */
+#define RECV_QUEUE 1024				/* datagrams between receive and a worker */
+#define MAX_WORKERS 16					/* protocol threads */
+#define MIN_SESSION_SLOTS 64
+#define SESSION_IDLE_SEC 600		/* unheard from this long, a session expires */
+#define EXPIRE_INTERVAL_SEC 60
 
-int last_commit_wid;
-int remote_fd;
-char filepath[2*MAX_FILE_LEN];
-CVector *wlog;
-//struct sockaddr_in *owner;
+/* 
+ * One open file of one client, keyed by the client's address and its fd.
+ * A closed session stays in the table, to answer a retried close, until 
+ * the table next grows.
+ */
+struct session {
+	struct sockaddr_in client;
+	int fd;
+	bool open;
+	unsigned generation;	/* new with each open, a commit job carries it */
+	int last_commit_wid;
+	int commit_in_flight;	/* to_wid of the commit on the disk thread, or -1 */
+	char filepath[2*MAX_FILE_LEN];
+	uint32_t group;		/* the file's multicast group */
+	WLog *wlog;
+	Stage *stage;			/* the log's blocks and last_commit_wid, on disk */
+	CVector *partials;	/* blocks still missing fragments, sorted by wid */
+	CVector *parities;	/* parity of groups missing more than one block */
+
+	/* wids seen since the last commit, gaps below high_wid are nacked */
+	int nack_from_wid;
+	int high_wid;
+	int aborted_from;	/* an abort above wids still nacked, skipped, or -1 */
+	int aborted_to;
+	bool nack_armed;
+	struct timeval nack_due;
+	int nack_tries;		/* NACKs sent since the client was last heard from */
+	struct timeval last_heard;
+};
+
+/* 
+ * Each protocol worker's own sessions, open addressing with linear 
+ * probing, at most half full 
+ */
+__thread struct session **sessions;
+__thread int nslots;
+__thread int nsessions;
+
+unsigned generations;
+
+/* sessions using each file group, it is left with the last one */
+pthread_mutex_t group_lock = PTHREAD_MUTEX_INITIALIZER;
+int group_users[FILE_GROUPS];
 
 char mountdir[MAX_FILE_LEN];
 
+/* a block bigger than a datagram, while its fragments arrive */
+struct partial_write {
+	struct write_block wb;
+	int nfrags;
+	int nrecv;
+	uint64_t *got;
+};
+
+void partial_free(void *p)
+{
+	struct partial_write *pw = (struct partial_write *) p;
+	free(pw->wb.data);
+	free(pw->got);
+}
+
+/* 
+ * Threads hand work over on lock-free queues, and wake the consumer, 
+ * asleep in its event loop, through an eventfd.
+ */
+int wake_fd()
+{
+	int efd = eventfd(0,EFD_NONBLOCK);
+	assert(efd >= 0);
+	return efd;
+}
+
+void wake(int efd)
+{
+	uint64_t one = 1;
+	if (write(efd,&one,sizeof(one)) < 0)
+		perror("eventfd");
+}
+
+/* called when efd is readable, before taking everything queued */
+void woken(int efd)
+{
+	uint64_t n;
+	if (read(efd,&n,sizeof(n)) < 0 && errno != EAGAIN)
+		perror("eventfd");
+}
+
+/* a received datagram, on its way from the receive thread */
+struct datagram {
+	struct sockaddr_in sender;
+	char buf[BUFFER_SIZE];
+};
+
+/* a commit's blocks, applied by the disk thread */
+struct commit_job {
+	CQueueNode node;
+	WLog *log;
+	char path[2*MAX_FILE_LEN];
+	struct apply *apply;
+	int fd;
+	struct worker *worker;	/* the session's, the reply goes back to it */
+	unsigned generation;		/* of the session that asked for it */
+	int from_wid;
+	int to_wid;
+	struct sockaddr_in client;
+	int result;
+};
+
+/* a session found at startup, for its worker to reopen */
+struct restored {
+	Stage *stage;
+	struct sockaddr_in client;
+	int fd;
+	char name[STAGE_NAME_LEN];
+	int last_commit_wid;
+};
+
+/* 
+ * A protocol thread. Sessions are spread over the workers by client and
+ * fd, and each owns its sessions outright, so files and clients are 
+ * served in parallel without locks on the protocol's state.
+ */
+struct worker {
+	CRing *received;				/* receive thread -> worker */
+	int received_efd;
+	CQueue done;						/* its commits, back from the disk thread */
+	int done_efd;
+	CVector *restored;			/* struct restored */
+};
+
+struct worker workers[MAX_WORKERS];
+int nworkers;
+__thread struct worker *self;
+
+CQueue disk_jobs;				/* workers -> disk thread */
+int disk_jobs_efd;
+
+/* a journaled commit on its way into its file, after the reply */
+struct apply {
+	char path[2*MAX_FILE_LEN];
+	int local_fd;
+	ExtMap *extents;
+};
+
+/* 
+ * Disk thread: commits being applied, those waiting for one on their 
+ * file, and new ones waiting out a checkpoint of the journal.
+ */
+Disk *disk;
+char *disk_backend;			/* -disk, NULL picks the best there is */
+Journal *journal;
+CVector *applying;			/* struct apply * */
+CVector *held;
+CVector *blocked;				/* struct commit_job * */
+
+uint32_t
+session_hash(struct sockaddr_in *client, int fd)
+{
+	uint32_t key[3] = { client->sin_addr.s_addr, client->sin_port, fd };
+	return crc32c(0,key,sizeof(key));
+}
+
+/* the worker that owns client's session for fd */
+struct worker *
+worker_for(struct sockaddr_in *client, int fd)
+{
+	return &workers[session_hash(client,fd) % nworkers];
+}
+
+struct session **
+session_slot(struct session **table, int size, struct sockaddr_in *client,
+						 int fd)
+{
+	int i = session_hash(client,fd) & (size - 1);
+	while (table[i] && (table[i]->fd != fd || 
+				 table[i]->client.sin_addr.s_addr != client->sin_addr.s_addr ||
+				 table[i]->client.sin_port != client->sin_port))
+		i = (i + 1) & (size - 1);
+	return &table[i];
+}
+
+struct session *
+find_session(struct sockaddr_in *client, int fd)
+{
+	return *session_slot(sessions,nslots,client,fd);
+}
+
+/* doubles the table when needed, closed sessions are dropped on the way */
 void
-reset_log()
+grow_sessions()
 {
-	if (wlog)
-  	CVectorDispose(wlog);
-  wlog = CVectorCreate(sizeof(struct write_block),0,wbfree);
+	if (2 * (nsessions + 1) <= nslots)
+		return;
+	int live = 0;
+	for (int i=0; i<nslots; i++)
+		live += sessions[i] && sessions[i]->open;
+	int size = MIN_SESSION_SLOTS;
+	while (size < 2 * (live + 1))
+		size *= 2;
+
+	struct session **table = calloc(size,sizeof(struct session *));
+	assert(table);
+	for (int i=0; i<nslots; i++) {
+		struct session *s = sessions[i];
+		if (s && s->open)
+			*session_slot(table,size,&s->client,s->fd) = s;
+		else if (s)
+			free(s);
+	}
+	free(sessions);
+	sessions = table;
+	nslots = size;
+	nsessions = live;
+}
+
+struct session *
+add_session(struct sockaddr_in *client, int fd)
+{
+	grow_sessions();
+	struct session *s = calloc(1,sizeof(struct session));
+	assert(s);
+	s->client = *client;
+	s->fd = fd;
+	*session_slot(sessions,nslots,client,fd) = s;
+	nsessions++;
+	return s;
+}
+
+/* the session a message from client is for, if the file is open */
+struct session *
+open_session(struct sockaddr_in *client, int fd)
+{
+	struct session *s = find_session(client,fd);
+	return s && s->open ? s : NULL;
+}
+
+void
+reset_log(struct session *s)
+{
+	if (s->wlog)
+  	WLogDispose(s->wlog);
+  s->wlog = WLogCreate();
+  if (s->partials)
+  	CVectorDispose(s->partials);
+  s->partials = CVectorCreate(sizeof(struct partial_write),0,partial_free);
+  if (s->parities)
+  	CVectorDispose(s->parities);
+  s->parities = CVectorCreate(sizeof(struct write_parity),0,NULL);
+  s->nack_from_wid = -1;
+  s->high_wid = -1;
+  s->aborted_from = -1;
+  s->aborted_to = -1;
+  s->nack_armed = false;
+}
+
+void
+free_log(struct session *s)
+{
+	WLogDispose(s->wlog);
+	CVectorDispose(s->partials);
+	CVectorDispose(s->parities);
+	s->wlog = NULL;
+	s->partials = NULL;
+	s->parities = NULL;
+}
+
+int
+join_group(uint32_t group)
+{
+	int success = NormalReturn;
+	pthread_mutex_lock(&group_lock);
+	int *users = &group_users[group - FILE_GROUP_BASE];
+	if (*users == 0 && netJoin(group) != 0)
+		success = ErrorReturn;
+	else
+		(*users)++;
+	pthread_mutex_unlock(&group_lock);
+	return success;
+}
+
+void
+leave_group(uint32_t group)
+{
+	pthread_mutex_lock(&group_lock);
+	if (--group_users[group - FILE_GROUP_BASE] == 0)
+		netLeave(group);
+	pthread_mutex_unlock(&group_lock);
+}
+
+void note_wid(struct session *s, int wid)
+{
+	if (wid <= s->last_commit_wid || wid <= s->commit_in_flight)
+		return;
+	if (s->nack_from_wid == -1 || wid < s->nack_from_wid)
+		s->nack_from_wid = wid;
+	if (wid > s->high_wid)
+		s->high_wid = wid;
+}
+
+/* the client is alive: its session stays, and its gaps are nacked afresh */
+void heard_from(struct session *s)
+{
+	gettimeofday(&s->last_heard,NULL);
+	s->nack_tries = 0;
+}
+
+/* 
+ * The log takes the block, and its staging area a copy, so a restart 
+ * does not lose it. Returns false, with the data freed, if there is no 
+ * room for it: the block counts as lost, to be nacked.
+ */
+bool keep_block(struct session *s, struct write_block *wb)
+{
+	if (!WLogFits(s->wlog,wb->wid) || 
+			StageAppend(s->stage,wb) != NormalReturn) {
+		free(wb->data);
+		return false;
+	}
+	WLogInsert(s->wlog,wb);
+	return true;
 }
 
 void 
 process_discover(struct sockaddr_in client)
 {
 	printf("discover msg received.\n");
-	send_discover_ack();
+	send_discover_ack(&client);
 }
 
 
@@ -54,23 +380,120 @@ process_open(struct replfs_msg *msg, struct sockaddr_in client)
 	printf("processing open msg...\n");
 	struct replfs_msg_open_long *payload = 
 										(struct replfs_msg_open_long *) get_payload(msg);
-	if (remote_fd == -1)		 {
-		assert(wlog);
-		//create the file
-		strcpy(filepath,mountdir);
-		strcat(filepath,payload->filename);
-		int local_fd = open(filepath,
-		 										  O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR);
-		if (local_fd > 0) {
-			close(local_fd);
-			remote_fd = payload->fd;
+	struct session *s = find_session(&client,payload->fd);
+	if (s && s->open) {
+		/* a retried open, our earlier success was lost */
+		heard_from(s);
+		if (!strcmp(s->filepath + strlen(mountdir),payload->filename)) {
 			printf("sending open success\n");
-			send_open_success(payload->fd);
-			return;
+			send_open_success(payload->fd, &client);
+		} else {
+			printf("sending open fail\n");
+			send_open_fail(payload->fd, &client);
 		}
+		return;
+	}
+
+	char filepath[2*MAX_FILE_LEN];
+	strcpy(filepath,mountdir);
+	strcat(filepath,payload->filename);
+	//create the file
+	int local_fd = open(filepath,
+	 										  O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR);
+	uint32_t group = file_group(payload->filename);
+	Stage *stage = NULL;
+	if (local_fd > 0 && 
+			(stage = StageCreate(mountdir,&client,payload->fd,payload->filename)) &&
+			join_group(group) == NormalReturn) {
+		close(local_fd);
+		if (!s)
+			s = add_session(&client,payload->fd);
+		s->stage = stage;
+		s->generation = __atomic_add_fetch(&generations,1,__ATOMIC_RELAXED);
+		strcpy(s->filepath,filepath);
+		s->group = group;
+		s->last_commit_wid = -1;
+		s->commit_in_flight = -1;
+		reset_log(s);
+		heard_from(s);
+		s->open = true;
+		printf("sending open success\n");
+		send_open_success(payload->fd, &client);
+		return;
 	}
+	if (local_fd > 0)
+		close(local_fd);
+	if (stage)
+		StageRemove(stage);
 	printf("sending open fail\n");
-	send_open_fail(payload->fd);
+	send_open_fail(payload->fd, &client);
+}
+
+/* a staged block of a session the server had before it restarted */
+void restage_block(struct write_block *wb, void *aux)
+{
+	struct session *s = (struct session *) aux;
+	if (wb->wid <= s->last_commit_wid)
+		return;
+	struct write_block copy = *wb;
+	copy.data = malloc(wb->len);
+	memcpy(copy.data,wb->data,wb->len);
+	if (!WLogInsert(s->wlog,&copy))
+		free(copy.data);
+	else
+		note_wid(s,copy.wid);
+}
+
+/* 
+ * Reopens a session from its staging area, as it was before a restart: 
+ * a try-commit of its blocks succeeds, and only the ones lost are nacked.
+ */
+void restore_session(Stage *stage, struct sockaddr_in *client, int fd, 
+										 const char *name, int last_commit_wid, void *aux)
+{
+	uint32_t group = file_group(name);
+	if (join_group(group) != NormalReturn) {
+		fprintf(stderr,"unable to reopen %s\n",name);
+		StageRemove(stage);
+		return;
+	}
+	struct session *s = add_session(client,fd);
+	s->generation = __atomic_add_fetch(&generations,1,__ATOMIC_RELAXED);
+	strcpy(s->filepath,mountdir);
+	strcat(s->filepath,name);
+	s->group = group;
+	s->last_commit_wid = last_commit_wid;
+	s->commit_in_flight = -1;
+	reset_log(s);
+	heard_from(s);
+	s->stage = stage;
+	s->open = true;
+	StageBlocks(stage,restage_block,s);
+	printf("restored fd %d on %s, %d block(s) staged\n",fd,name,
+				 WLogCount(s->wlog));
+}
+
+/* at startup, before the workers run, each reopens its own sessions */
+void stash_session(Stage *stage, struct sockaddr_in *client, int fd, 
+									 const char *name, int last_commit_wid, void *aux)
+{
+	struct restored r;
+	r.stage = stage;
+	r.client = *client;
+	r.fd = fd;
+	strcpy(r.name,name);
+	r.last_commit_wid = last_commit_wid;
+	CVectorAppend(worker_for(client,fd)->restored,&r);
+}
+
+void
+close_session(struct session *s)
+{
+	s->open = false;
+	leave_group(s->group);
+	free_log(s);
+	StageRemove(s->stage);
+	s->stage = NULL;
 }
 
 void
@@ -79,188 +502,641 @@ process_close(struct replfs_msg *msg, struct sockaddr_in client)
 	printf("processing close msg...\n");
 	struct replfs_msg_open *payload = 
 										(struct replfs_msg_open*) get_payload(msg);
-	if (payload->fd == remote_fd) {
-		remote_fd = -1;
-		// printf("write log\n");
-		// printf("--------------------------\n");
-		// print_write_log(wlog);
-		reset_log();
+	struct session *s = find_session(&client,payload->fd);
+	if (s && s->open) {
+		close_session(s);
+		printf("sending close success\n");
+		send_close_success(payload->fd, &client);
+	} else if (s) {
 		printf("sending close success\n");
-		send_close_success(payload->fd);
+		send_close_success(payload->fd, &client);
 	} else {
 		printf("sending close fail\n");	
-		send_close_fail(payload->fd);
+		send_close_fail(payload->fd, &client);
 	}
 
 }
 
-void process_write(struct replfs_msg *msg, struct sockaddr_in client) 
+/*
+ * Rebuilds the one block of a parity group that is missing. Returns false
+ * while two or more are, to try again as they arrive, and true once done 
+ * with the parity, also when a block in the group is longer than it.
+ */
+bool rebuild_from_parity(struct session *s, struct write_parity *parity)
+{
+	struct replfs_msg_parity *hdr = &parity->hdr;
+	char data[PARITY_MAX_LEN];
+	memcpy(data,parity->data,hdr->len);
+	int offset = hdr->offset;
+	int len = hdr->len_xor;
+	int missing = -1;
+
+	for (int wid=hdr->from_wid; wid<hdr->from_wid + hdr->n; wid++) {
+		struct write_block *wb = WLogGet(s->wlog,wid);
+		if (!wb) {
+			if (missing != -1)
+				return false;
+			missing = wid;
+			continue;
+		}
+		/* not a block this parity could cover, it is of no use */
+		if (wb->len > hdr->len)
+			return true;
+		xor_bytes(data,wb->data,wb->len);
+		offset ^= wb->offset;
+		len ^= wb->len;
+	}
+	if (missing == -1 || len < 0 || len > hdr->len)
+		return true;
+
+	printf("rebuilt wid %d from parity\n",missing);
+	struct write_block wb;
+	wb.fd = hdr->fd;
+	wb.wid = missing;
+	wb.offset = offset;
+	wb.len = len;
+	wb.data = malloc(len);
+	memcpy(wb.data,data,len);
+	if (keep_block(s,&wb))
+		note_wid(s,missing);
+	return true;
+}
+
+/* a block arrived, a group waiting on it may now be one short */
+void rebuild_group(struct session *s, int wid)
 {
-	if (remote_fd == -1 || !wlog)
+	for (int i=0; i<CVectorCount(s->parities); i++) {
+		struct write_parity *parity = CVectorNth(s->parities,i);
+		if (wid < parity->hdr.from_wid || 
+				wid >= parity->hdr.from_wid + parity->hdr.n)
+			continue;
+		if (rebuild_from_parity(s,parity))
+			CVectorRemove(s->parities,i);
 		return;
+	}
+}
+
+/* copies one block into the log, wb is an aligned copy of its header */
+void stage_write(struct sockaddr_in *client, struct write_block *wb,
+								 const char *dataload)
+{
+	struct session *s = open_session(client,wb->fd);
+	if (!s)
+		return;
+	heard_from(s);
+
+	/* duplicates are dropped on arrival, and wids too far off to hold */
+	if (WLogGet(s->wlog,wb->wid) || wb->wid <= s->commit_in_flight ||
+			wb->wid <= s->last_commit_wid || !WLogFits(s->wlog,wb->wid))
+		return;
+
+	wb->data = malloc(wb->len);
+	memcpy(wb->data,dataload,wb->len);
+	note_wid(s,wb->wid);
+	if (!keep_block(s,wb))
+		return;
+	rebuild_group(s,wb->wid);
+}
+
+void process_write(struct replfs_msg *msg, struct sockaddr_in client) 
+{
 	printf("processing write msg...\n"); 
-	struct write_block *payload = (struct write_block *) get_payload(msg);
-	if (payload->fd != remote_fd)
+	struct write_block wb;
+	memcpy(&wb,get_payload(msg),sizeof(wb));
+	if (wb.len < 0 || sizeof(struct replfs_msg) + sizeof(struct write_block) +
+										wb.len > msg->len)
 		return;
+	stage_write(&client,&wb,(char *) get_payload(msg) + sizeof(wb));
+}
 
-	void *dataload = ((char *)payload) + sizeof(struct write_block);
-	payload->data = malloc(payload->len);
-	memcpy(payload->data,dataload,payload->len);
-	CVectorAppend(wlog,payload);
+void process_write_batch(struct replfs_msg *msg, struct sockaddr_in client) 
+{
+	printf("processing write batch msg...\n"); 
+	int n = *(int *) get_payload(msg);
+	char *cur = ((char *) get_payload(msg)) + sizeof(int);
+	char *end = ((char *) msg) + msg->len;
+	/* headers follow each other's data unaligned, each is copied out */
+	for (int i=0; i<n; i++) {
+		struct write_block wb;
+		if (cur + sizeof(struct write_block) > end)
+			break;
+		memcpy(&wb,cur,sizeof(wb));
+		if (wb.len < 0 || wb.len > end - cur - (long) sizeof(wb))
+			break;
+		stage_write(&client,&wb,cur + sizeof(wb));
+		cur += sizeof(struct write_block) + wb.len;
+	}
 }
 
-void clear_write_log(int to_wid)
+void process_write_parity(struct replfs_msg *msg, struct sockaddr_in client) 
 {
-	assert(wlog);
-	for(int i=0;i<CVectorCount(wlog);) {
-		struct write_block *wb;
-		wb = (struct write_block *) CVectorNth(wlog,i);
-		if (wb->wid < to_wid) 
-			CVectorRemove(wlog,i);
-		else
-			i++;
+	printf("processing write parity msg...\n"); 
+	struct write_parity parity;
+	memcpy(&parity.hdr,get_payload(msg),sizeof(struct replfs_msg_parity));
+	struct replfs_msg_parity *hdr = &parity.hdr;
+	struct session *s = open_session(&client,hdr->fd);
+	if (!s || hdr->n <= 0 || hdr->n > MAX_STAGED_WRITES || hdr->len < 0 || 
+			hdr->len > PARITY_MAX_LEN || sizeof(struct replfs_msg) + 
+			sizeof(struct replfs_msg_parity) + hdr->len > msg->len ||
+			hdr->from_wid + hdr->n - 1 <= s->last_commit_wid ||
+			!WLogFits(s->wlog,hdr->from_wid + hdr->n - 1))
+		return;
+	memcpy(parity.data,((char *) get_payload(msg)) + 
+				 sizeof(struct replfs_msg_parity),hdr->len);
+	heard_from(s);
+
+	/* the group's last wid may be the one lost */
+	note_wid(s,hdr->from_wid + hdr->n - 1);
+	if (!rebuild_from_parity(s,&parity))
+		CVectorAppend(s->parities,&parity);
+}
+
+struct partial_write *find_partial(struct session *s, int wid)
+{
+	struct write_block key;
+	key.wid = wid;
+	int index = CVectorSearch(s->partials,&key,(CVectorCmpElemFn) wbcmp,0,true);
+	return index == -1 ? NULL : CVectorNth(s->partials,index);
+}
+
+/* reassembles MsgWriteFrag fragments, keyed by (fd, wid, fragment) */
+void process_write_frag(struct replfs_msg *msg, struct sockaddr_in client) 
+{
+	if (msg->len < sizeof(struct replfs_msg) + sizeof(struct replfs_msg_frag))
+		return;
+	struct replfs_msg_frag *payload = (struct replfs_msg_frag *) get_payload(msg);
+	struct write_block *wb = &payload->wb;
+	struct session *s = open_session(&client,wb->fd);
+	if (!s)
+		return;
+	heard_from(s);
+
+	/* as in stage_write, and a wid committed or on its way need no parts */
+	if (WLogGet(s->wlog,wb->wid) || !WLogFits(s->wlog,wb->wid) ||
+			wb->wid <= s->commit_in_flight || wb->wid <= s->last_commit_wid)
+		return;
+
+	/* each fragment carries exactly its share of the block */
+	int nfrags = frag_count(wb->len);
+	int len = msg->len - sizeof(struct replfs_msg) - 
+						sizeof(struct replfs_msg_frag);
+	if (wb->len <= 0 || wb->len > MAX_WRITE_LEN || payload->frag < 0 ||
+			payload->frag >= nfrags || len != frag_len(wb->len,payload->frag))
+		return;
+
+	note_wid(s,wb->wid);
+	struct partial_write *pw = find_partial(s,wb->wid);
+	if (!pw) {
+		struct partial_write fresh;
+		fresh.wb = *wb;
+		fresh.wb.data = malloc(wb->len);
+		fresh.nfrags = nfrags;
+		fresh.nrecv = 0;
+		fresh.got = calloc(nfrags / 64 + 1, sizeof(uint64_t));
+		CVectorAppend(s->partials,&fresh);
+		CVectorSort(s->partials,(CVectorCmpElemFn) wbcmp);
+		pw = find_partial(s,wb->wid);
+	}
+
+	int frag = payload->frag;
+	if (pw->wb.len != wb->len || (pw->got[frag >> 6] >> (frag & 63)) & 1)
+		return;
+	memcpy(pw->wb.data + frag_offset(frag),
+				 ((char *) payload) + sizeof(struct replfs_msg_frag),len);
+	pw->got[frag >> 6] |= 1ULL << (frag & 63);
+	if (++pw->nrecv < pw->nfrags)
+		return;
+
+	/* complete, the log takes over the data */
+	struct write_block done = pw->wb;
+	pw->wb.data = NULL;
+	keep_block(s,&done);
+	CVectorRemove(s->partials,
+								(pw - (struct partial_write *) CVectorFirst(s->partials)));
+}
+
+void clear_write_log(struct session *s, int to_wid)
+{
+	assert(s->wlog);
+	WLogTrim(s->wlog,to_wid);
+	StageTrim(s->stage,to_wid);
+	while (CVectorCount(s->partials) > 0 &&
+				 ((struct partial_write *) CVectorFirst(s->partials))->wb.wid < to_wid)
+		CVectorRemove(s->partials,0);
+	for (int i=CVectorCount(s->parities)-1; i>=0; i--) {
+		struct write_parity *parity = CVectorNth(s->parities,i);
+		if (parity->hdr.from_wid + parity->hdr.n <= to_wid)
+			CVectorRemove(s->parities,i);
+	}
+}
+
+/* 
+ * Drops one transaction's blocks, those below it may still be on their 
+ * way to a commit. Parity groups never span transactions.
+ */
+void drop_writes(struct session *s, int from_wid, int to_wid)
+{
+	WLogDrop(s->wlog,from_wid,to_wid);
+	StageDrop(s->stage,from_wid,to_wid);
+	for (int i=CVectorCount(s->partials)-1; i>=0; i--) {
+		struct partial_write *pw = CVectorNth(s->partials,i);
+		if (from_wid <= pw->wb.wid && pw->wb.wid <= to_wid)
+			CVectorRemove(s->partials,i);
+	}
+	for (int i=CVectorCount(s->parities)-1; i>=0; i--) {
+		struct write_parity *parity = CVectorNth(s->parities,i);
+		if (from_wid <= parity->hdr.from_wid && parity->hdr.from_wid <= to_wid)
+			CVectorRemove(s->parities,i);
 	}
 }
 
 /* range is inclusive */
-void append_range(CVector *missing, int from, int to)
+void append_range(int from, int to, void *aux)
 {
-	for (int i=from; i<=to; i++) {
-		// printf("(appending %d) ",i);
-		CVectorAppend(missing,&i);
+	CVector *missing = (CVector *) aux;
+	struct wid_range range;
+	range.from_wid = from;
+	range.to_wid = to;
+	CVectorAppend(missing,&range);
+}
+
+void append_frags(struct partial_write *pw, CVector *frags)
+{
+	for (int frag=0; frag<pw->nfrags; frag++) {
+		if ((pw->got[frag >> 6] >> (frag & 63)) & 1)
+			continue;
+		struct frag_range range;
+		range.wid = pw->wb.wid;
+		range.from_frag = frag;
+		while (frag + 1 < pw->nfrags && !((pw->got[(frag+1) >> 6] >> 
+																				((frag+1) & 63)) & 1))
+			frag++;
+		range.to_frag = frag;
+		CVectorAppend(frags,&range);
 	}
 }
 
-CVector *missing_writes(int from_wid, int to_wid)
+/* 
+ * Runs of missing wids go to ranges, except for blocks held in part, whose
+ * missing fragments go to frags. Returns how many entries were reported.
+ */
+int missing_writes(struct session *s, int from_wid, int to_wid, 
+									 CVector *ranges, CVector *frags)
 {
-	if (remote_fd == -1 || !wlog)
-		return NULL;
+	CVector *gaps = CVectorCreate(sizeof(struct wid_range),0,NULL);
+	WLogGaps(s->wlog,from_wid,to_wid,append_range,gaps);
 
-	CVectorSort(wlog,(CVectorCmpElemFn) wbcmp);
-	CVector *missing = CVectorCreate(sizeof(int),0,NULL);
-	struct write_block *curwb = (struct write_block *)CVectorFirst(wlog);
-	while (curwb && curwb->wid <= to_wid)
-	{
-		// printf("curwb->wid: %d, from_wid: %d, to_wid: %d ",
-			// curwb->wid,from_wid,to_wid);
-		if (curwb->wid >= from_wid) {
-			if (curwb->wid > from_wid) 
-				append_range(missing,from_wid,curwb->wid-1);
-			from_wid = curwb->wid+1;
+	struct partial_write *pw = CVectorFirst(s->partials);
+	for (struct wid_range *gap = CVectorFirst(gaps); gap != NULL; 
+			 gap = CVectorNext(gaps,gap)) {
+		int cur = gap->from_wid;
+		while (pw && pw->wb.wid < cur)
+			pw = CVectorNext(s->partials,pw);
+		while (pw && pw->wb.wid <= gap->to_wid) {
+			if (pw->wb.wid > cur)
+				append_range(cur,pw->wb.wid - 1,ranges);
+			append_frags(pw,frags);
+			cur = pw->wb.wid + 1;
+			pw = CVectorNext(s->partials,pw);
 		}
-		curwb = (struct write_block *) CVectorNext(wlog,curwb);
-		// printf("next: %p\n", curwb);
+		if (cur <= gap->to_wid)
+			append_range(cur,gap->to_wid,ranges);
 	}
-	append_range(missing,from_wid,to_wid);
-	return missing;
+	CVectorDispose(gaps);
+	return CVectorCount(ranges) + CVectorCount(frags);
 }
 
 void process_try_commit(struct replfs_msg *msg, struct sockaddr_in client) 
 {
-	if (remote_fd == -1)
-		return;
-	assert(wlog);
-
 	struct replfs_msg_commit *payload = 
 							(struct replfs_msg_commit *) get_payload(msg);
-	
-	if (payload->fd != remote_fd)
+	struct session *s = open_session(&client,payload->fd);
+	if (!s)
 		return; 
 
 	printf("processing try-commit msg...\n");
+	heard_from(s);
 
-	if (last_commit_wid >= payload->to_wid) {
-		send_try_commit_success(payload->fd, payload->from_wid, payload->to_wid);
+	if (s->last_commit_wid >= payload->to_wid || 
+			s->commit_in_flight >= payload->to_wid) {
+		send_try_commit_success(payload->fd, payload->from_wid, payload->to_wid,
+													&client);
 		return;
 	}
 	
-	clear_write_log(payload->from_wid);
-	CVector *missing = missing_writes(payload->from_wid, payload->to_wid);
-	if (missing && CVectorCount(missing) == 0) {
-		send_try_commit_success(payload->fd, payload->from_wid, payload->to_wid);
+	clear_write_log(s,payload->from_wid);
+	CVector *ranges = CVectorCreate(sizeof(struct wid_range),0,NULL);
+	CVector *frags = CVectorCreate(sizeof(struct frag_range),0,NULL);
+	if (missing_writes(s,payload->from_wid,payload->to_wid,ranges,frags) == 0) {
+		send_try_commit_success(payload->fd, payload->from_wid, payload->to_wid,
+													&client);
 	} else {
-		int n;
-		void * dataload = missing ? CVectorToArray(missing,&n) : NULL;
-		send_try_commit_fail(payload->fd,payload->from_wid,
-																		 payload->to_wid,dataload,n);
-		free(dataload);
+		send_try_commit_fail(payload->fd,payload->from_wid,payload->to_wid,
+												 CVectorFirst(ranges),CVectorCount(ranges),
+												 CVectorFirst(frags),CVectorCount(frags),&client);
 	}
+	CVectorDispose(ranges);
+	CVectorDispose(frags);
 }
 
-int execute_log(int fd, int from_wid, int to_wid)
+void log_journaled(int result, void *aux);
+
+/* 
+ * Runs on the disk thread, the log is the job's own. Its blocks are laid 
+ * over an extent map in wid order, so later wids win, and each block's 
+ * data is freed as soon as it is in. The extents go to the journal, and 
+ * log_journaled replies and applies them once the record is synced.
+ */
+int execute_log(struct commit_job *job)
 {
-	if (remote_fd == -1)
-		return ErrorReturn;
-	assert(wlog);
 	printf("executing log...\n");
-	CVectorSort(wlog,(CVectorCmpElemFn)wbcmp);
-	CVectorRemoveDuplicate(wlog,(CVectorCmpElemFn)wbcmp);
 
-	int local_fd = open(filepath, O_RDWR);
-	if (local_fd < 0) {
+	struct apply *a = malloc(sizeof(struct apply));
+	assert(a);
+	strcpy(a->path,job->path);
+	a->local_fd = open(job->path, O_RDWR);
+	if (a->local_fd < 0) {
 		perror("unable to open file");
+		free(a);
 		return ErrorReturn;
 	}
-	int success = NormalReturn;
-	struct write_block *wb = CVectorFirst(wlog);
-	while (wb != NULL) {
-		if (lseek(local_fd, wb->offset, SEEK_SET ) < 0 ) {
-			perror("seek failed");
-			success = ErrorReturn;
-			break;
-  	} if (write(local_fd,wb->data,wb->len) < 0) {
-  		perror("write failed");
-  		success = ErrorReturn;
-  		break;
-  	} 
-  	wb = CVectorNext(wlog,wb);
-	}
-	close(local_fd);
-	return success;
+	WLog *log = job->log;
+	a->extents = ExtMapCreate();
+	for (struct write_block *wb = WLogFirst(log); wb; wb = WLogNext(log,wb)) {
+		ExtMapWrite(a->extents,wb->offset,wb->data,wb->len);
+		free(wb->data);
+		wb->data = NULL;
+	}
+	printf("%d blocks in %d extents\n",WLogCount(log),
+				 ExtMapCount(a->extents));
+	job->apply = a;
+	JournalAppend(journal,job->path + strlen(mountdir),a->extents,
+								log_journaled,job);
+	return NormalReturn;
 }
 
+/* 
+ * Hands the transaction's blocks to the disk thread. The reply goes out 
+ * once the journal holds them durably (commit_done), and until then a 
+ * retried commit for the same range is ignored.
+ */
 void process_commit(struct replfs_msg *msg, struct sockaddr_in client) 
 {
-	if (remote_fd == -1)
-		return;
-	assert(wlog);
 	printf("processing commit msg...\n"); 
 	struct replfs_msg_commit *payload = 
 							(struct replfs_msg_commit *) get_payload(msg);
-	
-	if (payload->fd != remote_fd)
+	struct session *s = open_session(&client,payload->fd);
+	if (!s)
 		return; 
+	heard_from(s);
 	
-	if (last_commit_wid >= payload->to_wid) {
-		send_commit_success(payload->fd, payload->from_wid, payload->to_wid);
+	if (s->last_commit_wid >= payload->to_wid) {
+		send_commit_success(payload->fd, payload->from_wid, payload->to_wid,
+													&client);
 		return;
 	}
+	if (s->commit_in_flight >= payload->to_wid)
+		return;
 
-	clear_write_log(payload->from_wid);
-	CVector *missing = missing_writes(payload->from_wid, payload->to_wid);
-	if (CVectorCount(missing) == 0) {
-		if (execute_log(payload->fd,payload->from_wid,payload->to_wid) 
-																														== NormalReturn) {
-			reset_log();
-			last_commit_wid = payload->to_wid;
-			send_commit_success(payload->fd, payload->from_wid, payload->to_wid);
-			return;
+	clear_write_log(s,payload->from_wid);
+	CVector *ranges = CVectorCreate(sizeof(struct wid_range),0,NULL);
+	CVector *frags = CVectorCreate(sizeof(struct frag_range),0,NULL);
+	int nmissing = missing_writes(s,payload->from_wid,payload->to_wid,
+																ranges,frags);
+	CVectorDispose(ranges);
+	CVectorDispose(frags);
+	if (nmissing > 0) {
+		send_commit_fail(payload->fd,payload->from_wid,payload->to_wid,&client);
+		return;
+	}
+
+	struct commit_job *job = malloc(sizeof(struct commit_job));
+	assert(job);
+	job->log = WLogSplit(s->wlog,payload->to_wid + 1);
+	strcpy(job->path,s->filepath);
+	job->fd = payload->fd;
+	job->worker = self;
+	job->generation = s->generation;
+	job->from_wid = payload->from_wid;
+	job->to_wid = payload->to_wid;
+	job->client = client;
+	s->commit_in_flight = payload->to_wid;
+	s->nack_from_wid = payload->to_wid + 1;
+	if (s->high_wid < payload->to_wid)
+		s->high_wid = payload->to_wid;
+	CQueuePush(&disk_jobs,&job->node);
+	wake(disk_jobs_efd);
+}
+
+/* 
+ * Back on the protocol thread, once the disk thread journaled a commit. 
+ * If the file was closed since, and maybe opened again with its wids 
+ * starting over, nobody waits for the reply, and the session it would 
+ * update is not the one that asked.
+ */
+void commit_done(struct commit_job *job)
+{
+	struct session *s = open_session(&job->client,job->fd);
+	if (!s || s->generation != job->generation) {
+		printf("commit of a closed session done\n");
+		WLogDispose(job->log);
+		free(job);
+		return;
+	}
+	if (job->result == NormalReturn) {
+		/* on disk before the client hears of it, a restart keeps it */
+		if (s->last_commit_wid < job->to_wid) {
+			s->last_commit_wid = job->to_wid;
+			StageCommitted(s->stage,job->to_wid);
 		}
+		send_commit_success(job->fd,job->from_wid,job->to_wid,&job->client);
+	} else {
+		send_commit_fail(job->fd,job->from_wid,job->to_wid,&job->client);
 	}
-	send_commit_fail(payload->fd,payload->from_wid, payload->to_wid);
+	if (s->commit_in_flight == job->to_wid)
+		s->commit_in_flight = -1;
+	WLogDispose(job->log);
+	free(job);
 }
 
 void
 process_abort(struct replfs_msg *msg, struct sockaddr_in client)
 {
-	if (remote_fd == -1)
-		return;
-	assert(wlog);
 	struct replfs_msg_commit *payload = 
 							(struct replfs_msg_commit *) get_payload(msg);
-	if (payload->fd != remote_fd)
+	struct session *s = open_session(&client,payload->fd);
+	if (!s)
 		return; 
-	clear_write_log(payload->to_wid);	
+	heard_from(s);
+	drop_writes(s,payload->from_wid,payload->to_wid);
+	if (s->nack_from_wid != -1 && s->nack_from_wid < payload->from_wid) {
+		/* an earlier transaction may still miss wids, NACKs stop short */
+		if (s->aborted_from == -1)
+			s->aborted_from = payload->from_wid;
+		s->aborted_to = payload->to_wid;
+	} else {
+		s->nack_from_wid = payload->to_wid + 1;
+	}
+	if (s->high_wid < payload->to_wid)
+		s->high_wid = payload->to_wid;
+}
+
+/* 
+ * The last wid a NACK covers: those below high_wid, but not an aborted 
+ * range. Once the wids below that are all in, NACKs resume past it.
+ */
+int
+nack_to_wid(struct session *s)
+{
+	if (s->aborted_from != -1 && s->nack_from_wid >= s->aborted_from) {
+		if (s->nack_from_wid <= s->aborted_to)
+			s->nack_from_wid = s->aborted_to + 1;
+		s->aborted_from = -1;
+		s->aborted_to = -1;
+	}
+	if (s->aborted_from != -1 && s->aborted_from <= s->high_wid)
+		return s->aborted_from - 1;
+	return s->high_wid - 1;
+}
+
+/* a random point in [now + min_ms, now + min_ms + NACK_SPREAD_MS] */
+struct timeval
+nack_delay(struct timeval now, int min_ms)
+{
+	long delay_us = (min_ms + rand() % (NACK_SPREAD_MS + 1)) * 
+									MICROSEC_IN_MILLISEC + rand() % MICROSEC_IN_MILLISEC;
+	struct timeval delay = { delay_us / MICROSEC_IN_SEC, 
+													 delay_us % MICROSEC_IN_SEC };
+	return time_sum(now,delay);
+}
+
+/*
+ * Reports gaps below the highest wid seen while writes still stream in,
+ * so most repairs are done before the client's try-commit. Writes leave 
+ * the client in wid order, and the highest wid may still be arriving in 
+ * fragments, so only the wids below it count. 
+ *
+ * As in SRM, a NACK waits a random delay first, so that one replica's 
+ * NACK can stand in for the others' (see process_peer_nack), and is 
+ * repeated while the gaps remain, NACK_INTERVAL_MS or so after the first
+ * and twice as long after each one since. A client silent through 
+ * NACK_MAX_TRIES of them is likely gone, and is left alone until heard 
+ * from. Returns whether a NACK is pending, due at s->nack_due.
+ */
+bool
+nack_gaps(struct session *s, struct timeval now)
+{
+	if (!s->open || s->nack_from_wid == -1 || 
+			nack_to_wid(s) < s->nack_from_wid || s->nack_tries >= NACK_MAX_TRIES) {
+		s->nack_armed = false;
+		return false;
+	}
+
+	if (s->nack_armed && time_diff_us(s->nack_due,now) > 0)
+		return true;
+
+	CVector *ranges = CVectorCreate(sizeof(struct wid_range),0,NULL);
+	CVector *frags = CVectorCreate(sizeof(struct frag_range),0,NULL);
+	int to_wid = nack_to_wid(s);
+	bool gaps = missing_writes(s,s->nack_from_wid,to_wid,ranges,frags) > 0;
+	if (!gaps) {
+		/* everything up to to_wid is in, later scans start past it */
+		s->nack_from_wid = to_wid + 1;
+		s->nack_armed = false;
+	} else if (!s->nack_armed) {
+		s->nack_armed = true;
+		s->nack_due = nack_delay(now,NACK_DELAY_MS);
+	} else {
+		netSetGroup(s->group);
+		send_nack(s->fd,s->nack_from_wid,to_wid,
+							CVectorFirst(ranges),CVectorCount(ranges),
+							CVectorFirst(frags),CVectorCount(frags));
+		s->nack_due = nack_delay(now,NACK_INTERVAL_MS << s->nack_tries);
+		s->nack_tries++;
+	}
+	CVectorDispose(ranges);
+	CVectorDispose(frags);
+	return s->nack_armed;
+}
+
+bool
+range_reported(CVector *ranges, int wid)
+{
+	for (struct wid_range *r = CVectorFirst(ranges); r != NULL; 
+			 r = CVectorNext(ranges,r))
+		if (r->from_wid <= wid && wid <= r->to_wid)
+			return true;
+	return false;
+}
+
+void append_frag(struct frag_range *range, void *aux)
+{
+	CVectorAppend((CVector *) aux,range);
+}
+
+/*
+ * When a peer's NACK already asks for every wid and fragment ours would, 
+ * ours is held back another interval: the client's repair reaches all 
+ * of us.
+ */
+void
+hold_back_nack(struct session *s, CVector *peer_ranges, CVector *peer_frags)
+{
+	CVector *ranges = CVectorCreate(sizeof(struct wid_range),0,NULL);
+	CVector *frags = CVectorCreate(sizeof(struct frag_range),0,NULL);
+	missing_writes(s,s->nack_from_wid,nack_to_wid(s),ranges,frags);
+
+	bool covered = true;
+	for (struct wid_range *r = CVectorFirst(ranges); covered && r != NULL; 
+			 r = CVectorNext(ranges,r))
+		for (int wid=r->from_wid; covered && wid<=r->to_wid; wid++)
+			covered = range_reported(peer_ranges,wid);
+	for (struct frag_range *f = CVectorFirst(frags); covered && f != NULL;
+			 f = CVectorNext(frags,f)) {
+		covered = range_reported(peer_ranges,f->wid);
+		for (struct frag_range *pf = CVectorFirst(peer_frags); 
+				 !covered && pf != NULL; pf = CVectorNext(peer_frags,pf))
+			covered = pf->wid == f->wid && pf->from_frag <= f->from_frag &&
+								f->to_frag <= pf->to_frag;
+	}
+
+	if (covered) {
+		printf("peer nack covers ours, holding it back\n");
+		struct timeval now;
+		gettimeofday(&now,NULL);
+		s->nack_due = nack_delay(now,NACK_INTERVAL_MS << s->nack_tries);
+	}
+	CVectorDispose(ranges);
+	CVectorDispose(frags);
+}
+
+/* 
+ * A peer's NACK names the fd but not the client, so it is held against 
+ * every session with that fd awaiting its own NACK.
+ */
+void
+process_peer_nack(struct replfs_msg *msg)
+{
+	struct replfs_msg_nack *payload = 
+							(struct replfs_msg_nack *) get_payload(msg);
+	CVector *peer_ranges = NULL;
+	CVector *peer_frags = NULL;
+	for (int i=0; i<nslots; i++) {
+		struct session *s = sessions[i];
+		if (!s || !s->open || !s->nack_armed || s->fd != payload->fd)
+			continue;
+		if (!peer_ranges) {
+			peer_ranges = CVectorCreate(sizeof(struct wid_range),0,NULL);
+			peer_frags = CVectorCreate(sizeof(struct frag_range),0,NULL);
+			nack_ranges(msg,append_range,peer_ranges);
+			nack_frags(msg,append_frag,peer_frags);
+		}
+		hold_back_nack(s,peer_ranges,peer_frags);
+	}
+	if (peer_ranges) {
+		CVectorDispose(peer_ranges);
+		CVectorDispose(peer_frags);
+	}
 }
 
 void
@@ -317,29 +1193,393 @@ process_msg(struct replfs_msg * msg, struct sockaddr_in client)
 		case MsgAbort:
 			process_abort(msg,client);
 			break;
+		case MsgWriteBatch:
+			process_write_batch(msg,client);
+			break;
+		case MsgWriteFrag:
+			process_write_frag(msg,client);
+			break;
+		case MsgNack:
+			process_peer_nack(msg);
+			break;
+		case MsgWriteParity:
+			process_write_parity(msg,client);
+			break;
 		default:
 			printf("unknown msg type.\n");
 			break;
 	}
 }
 
+__thread int nack_timer;
+
+/* arms the timer for the earliest pending NACK, the caller is corked */
+void
+schedule_nack()
+{
+	struct timeval now, due;
+	gettimeofday(&now,NULL);
+	bool pending = false;
+	for (int i=0; i<nslots; i++) {
+		struct session *s = sessions[i];
+		if (!s || !nack_gaps(s,now))
+			continue;
+		if (!pending || time_diff_us(due,s->nack_due) > 0)
+			due = s->nack_due;
+		pending = true;
+	}
+	if (pending)
+		netTimerArm(nack_timer,due);
+	else
+		netTimerDisarm(nack_timer);
+}
+
+void
+on_nack_due(void *aux)
+{
+	netCork();
+	schedule_nack();
+	netUncork();
+}
+
+__thread int expire_timer;
+
+/* 
+ * Closes the sessions not heard from in SESSION_IDLE_SEC that have no 
+ * commit on the disk thread. Their client is most likely gone, and their
+ * staging areas would otherwise bring them back on every restart.
+ */
+void
+on_expire_due(void *aux)
+{
+	struct timeval now;
+	gettimeofday(&now,NULL);
+	for (int i=0; i<nslots; i++) {
+		struct session *s = sessions[i];
+		if (!s || !s->open || s->commit_in_flight != -1 ||
+				time_diff_us(now,s->last_heard) < 
+				(long) SESSION_IDLE_SEC * MICROSEC_IN_SEC)
+			continue;
+		printf("fd %d on %s expired\n",s->fd,s->filepath);
+		close_session(s);
+	}
+	struct timeval interval = { EXPIRE_INTERVAL_SEC, 0 };
+	netTimerArm(expire_timer,time_sum(now,interval));
+}
+
+/* 
+ * The server runs as a pipeline: one thread receives, protocol workers 
+ * (one of them this thread) each run the protocol for their share of the
+ * sessions, and one thread writes commits to disk, each on its own event
+ * loop. A slow commit no longer holds up the writes and NACKs of the next
+ * transaction, nor one busy file the others.
+ */
+
+void
+hand_over(struct worker *w, struct datagram *dg, bool *woke)
+{
+	while (!CRingPush(w->received,dg)) {
+		wake(w->received_efd);
+		sched_yield();
+	}
+	woke[w - workers] = true;
+}
+
+/* 
+ * Receive thread: validated datagrams go to the worker owning their 
+ * session as they are, with one wake-up per batch and worker. A peer's 
+ * NACK names no client, so every worker gets it, and discovery goes to 
+ * the first. While a ring is full it yields, and the socket buffer 
+ * absorbs the backlog.
+ */
+void
+on_readable(void *aux)
+{
+	struct net_ring *ring = (struct net_ring *) aux;
+	struct datagram dg;
+	size_t len;
+	void *msg;
+	bool woke[MAX_WORKERS] = { false };
+	if (netRecvReady(ring) <= 0)
+		return;
+	while ((msg = netRingNext(ring, &len, &dg.sender)) != NULL) {
+		memcpy(dg.buf,msg,len);
+		struct replfs_msg *m = (struct replfs_msg *) dg.buf;
+		int fd = msg_fd(m);
+		if (m->msg_type == MsgNack)
+			for (int i=0; i<nworkers; i++)
+				hand_over(&workers[i],&dg,woke);
+		else
+			hand_over(fd < 0 ? &workers[0] : worker_for(&dg.sender,fd),&dg,woke);
+	}
+	for (int i=0; i<nworkers; i++)
+		if (woke[i])
+			wake(workers[i].received_efd);
+}
+
+void *
+receive_main(void *aux)
+{
+	struct net_ring *ring = netRingCreate(RECV_BATCH);
+	struct net_loop *loop = netLoopCreate();
+	if (netLoopAdd(loop,netSocket(),on_readable,ring) < 0) {
+		fprintf(stderr,"unable to set up the receive loop\n");
+		exit(ErrorReturn);
+	}
+	while (true)
+		netLoopOnce(loop);
+	return NULL;
+}
+
+/* disk thread: back to the session's worker, which replies */
+void
+job_done(struct commit_job *job, int result)
+{
+	job->result = result;
+	CQueuePush(&job->worker->done,&job->node);
+	wake(job->worker->done_efd);
+}
+
+int
+find_apply(CVector *applies, const char *path)
+{
+	for (int i=0; i<CVectorCount(applies); i++)
+		if (!strcmp((*(struct apply **) CVectorNth(applies,i))->path,path))
+			return i;
+	return -1;
+}
+
+void log_applied(int result, void *aux);
+
+/* 
+ * Commits on one file are applied in the order they came, one at a time,
+ * as the disk may complete the writes of a batch in any order.
+ */
+void
+start_apply(struct apply *a)
+{
+	if (find_apply(applying,a->path) >= 0) {
+		CVectorAppend(held,&a);
+		return;
+	}
+	CVectorAppend(applying,&a);
+	DiskSubmit(disk,a->local_fd,a->extents,log_applied,a);
+}
+
+void start_job(struct commit_job *job);
+
+/* 
+ * Empties the journal once it is full and every record in it is applied.
+ * New commits wait meanwhile, so it cannot grow without bound.
+ */
+void
+maybe_checkpoint()
+{
+	if (!JournalFull(journal) || CVectorCount(applying) > 0 || 
+			CVectorCount(held) > 0 || !JournalIdle(journal))
+		return;
+	if (JournalCheckpoint(journal) != NormalReturn) {
+		fprintf(stderr,"unable to checkpoint, restart to replay the journal\n");
+		exit(ErrorReturn);
+	}
+	while (CVectorCount(blocked) > 0 && !JournalFull(journal)) {
+		struct commit_job *job = *(struct commit_job **) CVectorNth(blocked,0);
+		CVectorRemove(blocked,0);
+		start_job(job);
+	}
+}
+
+void
+start_job(struct commit_job *job)
+{
+	if (JournalFull(journal)) {
+		CVectorAppend(blocked,&job);
+		maybe_checkpoint();
+		return;
+	}
+	if (execute_log(job) != NormalReturn)
+		job_done(job,ErrorReturn);
+}
+
+/* the commit is durable: reply, then bring the file up to date */
+void
+log_journaled(int result, void *aux)
+{
+	struct commit_job *job = (struct commit_job *) aux;
+	struct apply *a = job->apply;
+	job_done(job,result);
+	if (result != NormalReturn) {
+		close(a->local_fd);
+		ExtMapDispose(a->extents);
+		free(a);
+		maybe_checkpoint();
+		return;
+	}
+	start_apply(a);
+}
+
+/* 
+ * The reply has gone out, so a commit that cannot reach its file stops
+ * the server; the journal still holds it for the restart to replay.
+ */
+void
+log_applied(int result, void *aux)
+{
+	struct apply *a = (struct apply *) aux;
+	if (result != NormalReturn) {
+		fprintf(stderr,"unable to apply a commit, restart to replay the journal\n");
+		exit(ErrorReturn);
+	}
+	close(a->local_fd);
+	ExtMapDispose(a->extents);
+	CVectorRemove(applying,find_apply(applying,a->path));
+
+	int next = find_apply(held,a->path);
+	if (next >= 0) {
+		struct apply *waiting = *(struct apply **) CVectorNth(held,next);
+		CVectorRemove(held,next);
+		start_apply(waiting);
+	}
+	free(a);
+	maybe_checkpoint();
+}
+
+void
+on_disk_job(void *aux)
+{
+	CQueueNode *node;
+	woken(disk_jobs_efd);
+	while ((node = CQueuePop(&disk_jobs)) != NULL)
+		start_job(CQueueEntry(node,struct commit_job,node));
+}
+
+void
+on_disk_reaped(void *aux)
+{
+	DiskReap(disk);
+}
+
+void *
+disk_main(void *aux)
+{
+	struct net_loop *loop = netLoopCreate();
+	if (netLoopAdd(loop,disk_jobs_efd,on_disk_job,NULL) < 0 ||
+			netLoopAdd(loop,DiskEventFd(disk),on_disk_reaped,NULL) < 0 ||
+			!(journal = JournalOpen(mountdir,disk,loop))) {
+		fprintf(stderr,"unable to set up the disk loop\n");
+		exit(ErrorReturn);
+	}
+	while (true)
+		netLoopOnce(loop);
+	return NULL;
+}
+
+/* 
+ * Protocol worker: datagrams are handled in place in the ring, and 
+ * replies to the whole batch leave in one sendmmsg 
+ */
+void
+on_received(void *aux)
+{
+	struct datagram *dg;
+	woken(self->received_efd);
+	netCork();
+	while ((dg = CRingPeek(self->received)) != NULL) {
+		process_msg((struct replfs_msg *) dg->buf, dg->sender);
+		CRingDrop(self->received);
+	}
+	schedule_nack();
+	netUncork();
+}
+
+void
+on_commit_done(void *aux)
+{
+	CQueueNode *node;
+	woken(self->done_efd);
+	netCork();
+	while ((node = CQueuePop(&self->done)) != NULL)
+		commit_done(CQueueEntry(node,struct commit_job,node));
+	netUncork();
+}
+
+void *
+worker_main(void *aux)
+{
+	self = (struct worker *) aux;
+	nslots = MIN_SESSION_SLOTS;
+	sessions = calloc(nslots,sizeof(struct session *));
+	assert(sessions);
+
+	struct net_loop *loop = netLoopCreate();
+	if (netLoopAdd(loop,self->received_efd,on_received,NULL) < 0 ||
+			netLoopAdd(loop,self->done_efd,on_commit_done,NULL) < 0 ||
+			(nack_timer = netTimerCreate(loop,on_nack_due,NULL)) < 0 ||
+			(expire_timer = netTimerCreate(loop,on_expire_due,NULL)) < 0) {
+		fprintf(stderr,"unable to set up a protocol worker\n");
+		exit(ErrorReturn);
+	}
+
+	/* sessions open before a restart pick up where they were */
+	for (int i=0; i<CVectorCount(self->restored); i++) {
+		struct restored *r = CVectorNth(self->restored,i);
+		restore_session(r->stage,&r->client,r->fd,r->name,r->last_commit_wid,
+										NULL);
+	}
+	CVectorDispose(self->restored);
+	self->restored = NULL;
+	on_expire_due(NULL);
+
+	while (true)
+		netLoopOnce(loop);
+	//extension: send keep alive message
+
+	netLoopDispose(loop);
+	return NULL;
+}
+
 void
 run_server()
 {
 	printf("server running...\n");
 
-	struct sockaddr_in client;
-	struct timeval deadline;
-	gettimeofday(&deadline,NULL);
-	deadline.tv_sec += MAX_IDLE_TIME;
+	CQueueInit(&disk_jobs);
+	disk_jobs_efd = wake_fd();
+	if (!(disk = DiskCreate(disk_backend))) {
+		fprintf(stderr,"unable to set up the disk backend\n");
+		return;
+	}
+	printf("disk backend: %s\n",DiskName(disk));
+	applying = CVectorCreate(sizeof(struct apply *),0,NULL);
+	held = CVectorCreate(sizeof(struct apply *),0,NULL);
+	blocked = CVectorCreate(sizeof(struct commit_job *),0,NULL);
 
-	char buf[BUFFER_SIZE];
-	while (true) {
-			netRecv(buf, BUFFER_SIZE, &client,deadline);
-			process_msg((struct replfs_msg *) buf, client);
-			deadline.tv_sec += MAX_IDLE_TIME;
-			//extension: send keep alive message
+	for (int i=0; i<nworkers; i++) {
+		struct worker *w = &workers[i];
+		w->received = CRingCreate(sizeof(struct datagram),RECV_QUEUE);
+		w->received_efd = wake_fd();
+		CQueueInit(&w->done);
+		w->done_efd = wake_fd();
+		w->restored = CVectorCreate(sizeof(struct restored),0,NULL);
 	}
+	if (StageRecover(mountdir,stash_session,NULL) != NormalReturn) {
+		fprintf(stderr,"unable to recover the staged writes\n");
+		return;
+	}
+	printf("%d protocol worker(s)\n",nworkers);
+
+	pthread_t receiver, disk, worker;
+	if (pthread_create(&receiver,NULL,receive_main,NULL) ||
+			pthread_create(&disk,NULL,disk_main,NULL)) {
+		fprintf(stderr,"unable to start the server threads\n");
+		return;
+	}
+	for (int i=1; i<nworkers; i++)
+		if (pthread_create(&worker,NULL,worker_main,&workers[i])) {
+			fprintf(stderr,"unable to start the server threads\n");
+			return;
+		}
+	worker_main(&workers[0]);
 }
 
 int
@@ -348,6 +1588,12 @@ main(int argc, char *argv[]) {
 	unsigned short port = DEFAULT_PORT;
 	int drop = 0;
 	strcpy(mountdir,".");
+	/* one protocol worker per core */
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers < 1)
+		nworkers = 1;
+	if (nworkers > MAX_WORKERS)
+		nworkers = MAX_WORKERS;
 
 	for (int i=1; i<argc-1;i++) 
 	{
@@ -366,15 +1612,26 @@ main(int argc, char *argv[]) {
 			drop = atoi(argv[++i]);
 		}
 
+		else if (!strncmp(argv[i], "-disk",MAX_ARG_LEN)) {
+			if (*argv[i+1] == '-') ERROR("invalid disk backend");
+			disk_backend = argv[++i];
+		}
+
+		else if (!strncmp(argv[i], "-workers",MAX_ARG_LEN)) {
+			if (*argv[i+1] == '-') ERROR("invalid worker count");
+			nworkers = atoi(argv[++i]);
+			if (nworkers < 1 || nworkers > MAX_WORKERS) 
+				ERROR("invalid worker count");
+		}
+
 	}
 
 	mkdir(mountdir,S_IRWXU | S_IRUSR);
 	strcat(mountdir,"/");
 
-	/* empty file */
-	remote_fd = -1;
-	last_commit_wid = -1;
-	reset_log();
+	/* commits acknowledged before a crash reach their files first */
+	if (JournalRecover(mountdir) != NormalReturn)
+		ERROR("unable to replay the journal");
 
 
 	printf("launching file server...\n");
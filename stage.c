@@ -0,0 +1,368 @@
+#define _GNU_SOURCE		/* mremap() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "stage.h"
+#include "utils.h"
+#include "crc32c.h"
+
+#define STAGE_MAGIC 0x47545352	/* "RSTG" */
+#define STAGE_PATH_LEN 512
+
+struct stage_header {
+	uint32_t magic;					/* set last, a half made area is ignored */
+	uint32_t addr;
+	uint32_t port;
+	int32_t fd;
+	int32_t last_commit_wid;
+	int32_t from_wid;				/* blocks below it are dropped */
+	uint32_t used;					/* bytes of records after the header */
+	char name[STAGE_NAME_LEN];
+};
+
+/* each block: this, then its data */
+struct stage_record {
+	int32_t wid;
+	int32_t offset;
+	int32_t len;
+	uint32_t crc;						/* of the data */
+};
+
+struct stage {
+	char path[STAGE_PATH_LEN];
+	struct stage_header *h;		/* the mapping */
+	size_t size;
+	int low_wid;						/* lowest wid held, INT_MAX when none */
+};
+
+static char *
+records(Stage *st)
+{
+	return (char *) (st->h + 1);
+}
+
+/* bytes of records that fit the mapping, whatever the header says */
+static uint32_t
+records_len(Stage *st)
+{
+	size_t room = st->size - sizeof(struct stage_header);
+	return st->h->used < room ? st->h->used : room;
+}
+
+/*
+ * Calls fn on each intact record, in place, until a torn one. Records
+ * are only ever appended at the end, before used is raised over them.
+ */
+static void
+each_record(Stage *st, void (*fn)(Stage *, struct stage_record *, char *,
+																	void *), void *aux)
+{
+	char *p = records(st), *end = p + records_len(st);
+	while (p + sizeof(struct stage_record) <= end) {
+		struct stage_record r;
+		memcpy(&r,p,sizeof(r));
+		char *data = p + sizeof(r);
+		if (r.len < 0 || r.len > end - data ||
+				crc32c(0,data,r.len) != r.crc)
+			break;
+		fn(st,&r,data,aux);
+		p = data + r.len;
+	}
+}
+
+/* the file is sized with fallocate, so a full disk cannot fault a store */
+static int
+resize(Stage *st, size_t size)
+{
+	int fd = open(st->path,O_RDWR);
+	if (fd < 0)
+		return ErrorReturn;
+	int success = NormalReturn;
+	void *map = MAP_FAILED;
+	if (size > st->size) {
+		if ((errno = posix_fallocate(fd,0,size)) != 0 ||
+				(map = mremap(st->h,st->size,size,MREMAP_MAYMOVE)) == MAP_FAILED)
+			success = ErrorReturn;
+	} else {
+		if ((map = mremap(st->h,st->size,size,MREMAP_MAYMOVE)) == MAP_FAILED ||
+				ftruncate(fd,size) < 0)
+			success = ErrorReturn;
+	}
+	close(fd);
+	if (map != MAP_FAILED) {
+		st->h = map;
+		st->size = size;
+	}
+	if (success != NormalReturn)
+		perror("unable to resize a staging area");
+	return success;
+}
+
+static Stage *
+map_stage(const char *path, int fd, size_t size)
+{
+	void *map = mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+	if (map == MAP_FAILED)
+		return NULL;
+	Stage *st = calloc(1,sizeof(struct stage));
+	assert(st);
+	strcpy(st->path,path);
+	st->h = map;
+	st->size = size;
+	st->low_wid = INT_MAX;
+	return st;
+}
+
+static void
+free_stage(Stage *st)
+{
+	munmap(st->h,st->size);
+	free(st);
+}
+
+Stage *
+StageCreate(const char *dir, struct sockaddr_in *client, int fd,
+						const char *name)
+{
+	if (strlen(name) >= STAGE_NAME_LEN)
+		return NULL;
+	char path[STAGE_PATH_LEN];
+	snprintf(path,sizeof(path),"%s%s%08x-%04x-%d",dir,STAGE_PREFIX,
+					 ntohl(client->sin_addr.s_addr),ntohs(client->sin_port),fd);
+	int file = open(path,O_RDWR | O_CREAT | O_TRUNC,S_IRUSR | S_IWUSR);
+	if (file < 0) {
+		perror("unable to create a staging area");
+		return NULL;
+	}
+	Stage *st = NULL;
+	if ((errno = posix_fallocate(file,0,STAGE_MIN_BYTES)) != 0 ||
+			!(st = map_stage(path,file,STAGE_MIN_BYTES))) {
+		perror("unable to map a staging area");
+		close(file);
+		unlink(path);
+		return NULL;
+	}
+	close(file);
+
+	struct stage_header *h = st->h;
+	h->addr = client->sin_addr.s_addr;
+	h->port = client->sin_port;
+	h->fd = fd;
+	h->last_commit_wid = -1;
+	h->from_wid = 0;
+	h->used = 0;
+	strcpy(h->name,name);
+	__atomic_store_n(&h->magic,STAGE_MAGIC,__ATOMIC_RELEASE);
+	return st;
+}
+
+void
+StageRemove(Stage *st)
+{
+	assert(st);
+	unlink(st->path);
+	free_stage(st);
+}
+
+int
+StageAppend(Stage *st, struct write_block *wb)
+{
+	assert(st);
+	size_t need = sizeof(struct stage_record) + wb->len;
+	size_t total = sizeof(struct stage_header) + st->h->used + need;
+	if (total > st->size) {
+		size_t size = st->size;
+		while (size < total)
+			size *= 2;
+		if (resize(st,size) != NormalReturn)
+			return ErrorReturn;
+	}
+
+	struct stage_record r = { wb->wid, wb->offset, wb->len,
+														crc32c(0,wb->data,wb->len) };
+	char *p = records(st) + st->h->used;
+	memcpy(p,&r,sizeof(r));
+	memcpy(p + sizeof(r),wb->data,wb->len);
+	__atomic_store_n(&st->h->used,st->h->used + need,__ATOMIC_RELEASE);
+	if (wb->wid < st->low_wid)
+		st->low_wid = wb->wid;
+	return NormalReturn;
+}
+
+struct squeeze {
+	char *to;
+	int low_wid;
+	int drop_from;					/* a range dropped as well, if not empty */
+	int drop_to;
+};
+
+static void
+keep_record(Stage *st, struct stage_record *r, char *data, void *aux)
+{
+	struct squeeze *sq = (struct squeeze *) aux;
+	if (r->wid < st->h->from_wid ||
+			(sq->drop_from <= r->wid && r->wid <= sq->drop_to))
+		return;
+	memmove(sq->to,data - sizeof(*r),sizeof(*r) + r->len);
+	sq->to += sizeof(*r) + r->len;
+	if (r->wid < sq->low_wid)
+		sq->low_wid = r->wid;
+}
+
+/*
+ * Moves the records still wanted down over the dropped ones, then gives
+ * back what the area no longer needs. from_wid is raised first, so a crash
+ * midway at worst loses blocks, which the client then sends again, or
+ * brings back some of [drop_from,drop_to], which the next commit's trim
+ * drops.
+ */
+static void
+squeeze(Stage *st, int drop_from, int drop_to)
+{
+	struct squeeze sq = { records(st), INT_MAX, drop_from, drop_to };
+	each_record(st,keep_record,&sq);
+	__atomic_store_n(&st->h->used,(uint32_t) (sq.to - records(st)),
+									 __ATOMIC_RELEASE);
+	st->low_wid = sq.low_wid;
+
+	size_t size = st->size;
+	while (size > STAGE_MIN_BYTES &&
+				 sizeof(struct stage_header) + st->h->used <= size / 4)
+		size /= 2;
+	if (size < st->size)
+		resize(st,size);
+}
+
+void
+StageTrim(Stage *st, int wid)
+{
+	assert(st);
+	if (wid <= st->h->from_wid)
+		return;
+	st->h->from_wid = wid;
+	if (st->low_wid < wid)
+		squeeze(st,0,-1);
+}
+
+void
+StageDrop(Stage *st, int from_wid, int to_wid)
+{
+	assert(st);
+	if (from_wid <= to_wid && st->low_wid <= to_wid)
+		squeeze(st,from_wid,to_wid);
+}
+
+void
+StageCommitted(Stage *st, int wid)
+{
+	assert(st);
+	if (wid > st->h->last_commit_wid)
+		st->h->last_commit_wid = wid;
+	StageTrim(st,wid + 1);
+}
+
+struct each_block {
+	StageBlockFn fn;
+	void *aux;
+};
+
+static void
+call_block(Stage *st, struct stage_record *r, char *data, void *aux)
+{
+	struct each_block *eb = (struct each_block *) aux;
+	if (r->wid < st->h->from_wid)
+		return;
+	struct write_block wb;
+	wb.fd = st->h->fd;
+	wb.wid = r->wid;
+	wb.offset = r->offset;
+	wb.len = r->len;
+	wb.data = data;
+	eb->fn(&wb,eb->aux);
+}
+
+void
+StageBlocks(Stage *st, StageBlockFn fn, void *aux)
+{
+	assert(st);
+	struct each_block eb = { fn, aux };
+	each_record(st,call_block,&eb);
+}
+
+static void
+note_low(Stage *st, struct stage_record *r, char *data, void *aux)
+{
+	if (r->wid >= st->h->from_wid && r->wid < st->low_wid)
+		st->low_wid = r->wid;
+}
+
+/* maps one staging area, NULL if it is not one or is damaged */
+static Stage *
+recover_stage(const char *path)
+{
+	int fd = open(path,O_RDWR);
+	if (fd < 0)
+		return NULL;
+	struct stat st_buf;
+	Stage *st = NULL;
+	if (fstat(fd,&st_buf) == 0 &&
+			st_buf.st_size >= (off_t) sizeof(struct stage_header))
+		st = map_stage(path,fd,st_buf.st_size);
+	close(fd);
+	if (!st)
+		return NULL;
+
+	struct stage_header *h = st->h;
+	if (h->magic != STAGE_MAGIC ||
+			memchr(h->name,'\0',STAGE_NAME_LEN) == NULL || strchr(h->name,'/')) {
+		free_stage(st);
+		return NULL;
+	}
+	each_record(st,note_low,NULL);
+	return st;
+}
+
+int
+StageRecover(const char *dir, StageFoundFn found, void *aux)
+{
+	DIR *d = opendir(dir);
+	if (!d) {
+		perror("unable to look for staging areas");
+		return ErrorReturn;
+	}
+	int nfound = 0;
+	struct dirent *entry;
+	while ((entry = readdir(d)) != NULL) {
+		if (strncmp(entry->d_name,STAGE_PREFIX,strlen(STAGE_PREFIX)))
+			continue;
+		char path[STAGE_PATH_LEN];
+		snprintf(path,sizeof(path),"%s%s",dir,entry->d_name);
+		Stage *st = recover_stage(path);
+		if (!st) {
+			fprintf(stderr,"dropping damaged staging area %s\n",entry->d_name);
+			unlink(path);
+			continue;
+		}
+		struct sockaddr_in client;
+		memset(&client,0,sizeof(client));
+		client.sin_family = AF_INET;
+		client.sin_addr.s_addr = st->h->addr;
+		client.sin_port = st->h->port;
+		found(st,&client,st->h->fd,st->h->name,st->h->last_commit_wid,aux);
+		nfound++;
+	}
+	closedir(d);
+	printf("recovered %d staging area(s)\n",nfound);
+	return NormalReturn;
+}
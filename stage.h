@@ -0,0 +1,57 @@
+#ifndef __STAGE_H__
+#define __STAGE_H__
+
+#include <stdbool.h>
+#include <netinet/in.h>
+#include "protocol.h"
+
+/*
+ * A session's staged blocks and commit watermark, kept in a file of the
+ * mount directory mapped into memory, so they outlive the server process.
+ * Blocks are appended as they arrive, and those a commit or abort leaves
+ * behind are squeezed out. A restarted server finds every staging area
+ * with StageRecover and rebuilds its sessions from them, so it answers
+ * try-commits in flight without the client sending its log again.
+ *
+ * The mapping is never synced: a power failure loses the staging areas,
+ * which only costs a resend, commits themselves are in the journal.
+ */
+#define STAGE_PREFIX ".replfs-stage-"
+#define STAGE_NAME_LEN 128
+#define STAGE_MIN_BYTES (64 * 1024)
+
+typedef struct stage Stage;
+
+/* a staging area found at startup, the callback takes it over */
+typedef void (*StageFoundFn)(Stage *st, struct sockaddr_in *client, int fd,
+														 const char *name, int last_commit_wid, void *aux);
+
+/* wb->data points into the area, and is only valid during the call */
+typedef void (*StageBlockFn)(struct write_block *wb, void *aux);
+
+/* an empty area for client's fd, open on name relative to the mount directory */
+Stage *StageCreate(const char *dir, struct sockaddr_in *client, int fd,
+									 const char *name);
+
+/* unmaps the area and deletes its file, once the session is closed */
+void StageRemove(Stage *st);
+
+/* copies the block in, ErrorReturn if the area cannot grow to hold it */
+int StageAppend(Stage *st, struct write_block *wb);
+
+/* drops every block below wid */
+void StageTrim(Stage *st, int wid);
+
+/* drops every block in [from_wid,to_wid] */
+void StageDrop(Stage *st, int from_wid, int to_wid);
+
+/* records a commit through wid, dropping the blocks it covered */
+void StageCommitted(Stage *st, int wid);
+
+/* every block held, in arrival order */
+void StageBlocks(Stage *st, StageBlockFn fn, void *aux);
+
+/* maps every staging area of dir, handing each to found */
+int StageRecover(const char *dir, StageFoundFn found, void *aux);
+
+#endif
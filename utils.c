@@ -22,6 +22,13 @@ long time_diff_ms(struct timeval ta, struct timeval tb)
   return diff;
 }
 
+long time_diff_us(struct timeval ta, struct timeval tb)
+{
+  long diff = (ta.tv_sec - tb.tv_sec) * MICROSEC_IN_SEC +
+              (ta.tv_usec - tb.tv_usec);
+  return diff;
+}
+
 struct timeval time_sum(struct timeval ta, struct timeval tb)
 {
   struct timeval sum;
@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "wlog.h"
+
+#define MIN_SLOTS 64		/* a multiple of the bitmap word size */
+
+struct wlog {
+	struct write_block *slots;
+	uint64_t *bits;			/* received wids, by slot */
+	int nslots;					/* power of two, always > hi - lo */
+	int count;
+	int lo;							/* lowest and highest wid held */
+	int hi;
+};
+
+static int
+slot_of(WLog *wl, int wid)
+{
+	return wid & (wl->nslots - 1);
+}
+
+static bool
+has_slot(WLog *wl, int slot)
+{
+	return (wl->bits[slot >> 6] >> (slot & 63)) & 1;
+}
+
+static void
+alloc_slots(WLog *wl, int nslots)
+{
+	wl->nslots = nslots;
+	wl->slots = malloc(nslots * sizeof(struct write_block));
+	wl->bits = calloc(nslots / 64, sizeof(uint64_t));
+	assert(wl->slots && wl->bits);
+}
+
+/*
+ * Next held wid in [wid,to], or to+1. Only valid within [lo,hi], where
+ * the span is shorter than the ring and slots cannot alias.
+ */
+static int
+next_held(WLog *wl, int wid, int to)
+{
+	while (wid <= to) {
+		int slot = slot_of(wl,wid);
+		uint64_t word = wl->bits[slot >> 6] >> (slot & 63);
+		if (word) {
+			wid += __builtin_ctzll(word);
+			break;
+		}
+		wid += 64 - (slot & 63);
+	}
+	return wid <= to ? wid : to + 1;
+}
+
+/* next wid in [wid,to] that is not held, or to+1 */
+static int
+next_missing(WLog *wl, int wid, int to)
+{
+	while (wid <= to) {
+		int slot = slot_of(wl,wid);
+		uint64_t word = ~wl->bits[slot >> 6] >> (slot & 63);
+		if (word) {
+			wid += __builtin_ctzll(word);
+			break;
+		}
+		wid += 64 - (slot & 63);
+	}
+	return wid <= to ? wid : to + 1;
+}
+
+static void
+grow(WLog *wl, int span)
+{
+	struct write_block *old_slots = wl->slots;
+	uint64_t *old_bits = wl->bits;
+	int old_nslots = wl->nslots;
+
+	int nslots = old_nslots;
+	while (nslots < span)
+		nslots *= 2;
+	alloc_slots(wl,nslots);
+
+	for (int i=0; i<old_nslots; i++) {
+		if (!((old_bits[i >> 6] >> (i & 63)) & 1))
+			continue;
+		int slot = slot_of(wl,old_slots[i].wid);
+		wl->slots[slot] = old_slots[i];
+		wl->bits[slot >> 6] |= 1ULL << (slot & 63);
+	}
+	free(old_slots);
+	free(old_bits);
+}
+
+WLog *
+WLogCreate()
+{
+	WLog *wl = malloc(sizeof(struct wlog));
+	assert(wl);
+	alloc_slots(wl,MIN_SLOTS);
+	wl->count = 0;
+	wl->lo = 0;
+	wl->hi = -1;
+	return wl;
+}
+
+void
+WLogDispose(WLog *wl)
+{
+	assert(wl);
+	WLogTrim(wl,wl->hi + 1);
+	free(wl->slots);
+	free(wl->bits);
+	free(wl);
+}
+
+int
+WLogCount(WLog *wl)
+{
+	assert(wl);
+	return wl->count;
+}
+
+bool
+WLogFits(WLog *wl, int wid)
+{
+	assert(wl);
+	if (wid < 0)
+		return false;
+	if (!wl->count)
+		return true;
+	long lo = wid < wl->lo ? wid : wl->lo;
+	long hi = wid > wl->hi ? wid : wl->hi;
+	return hi - lo < MAX_STAGED_WRITES;
+}
+
+bool
+WLogInsert(WLog *wl, struct write_block *wb)
+{
+	assert(wl);
+	if (WLogGet(wl,wb->wid) || !WLogFits(wl,wb->wid))
+		return false;
+
+	int lo = wl->count ? (wb->wid < wl->lo ? wb->wid : wl->lo) : wb->wid;
+	int hi = wl->count ? (wb->wid > wl->hi ? wb->wid : wl->hi) : wb->wid;
+	if (hi - lo >= wl->nslots)
+		grow(wl,hi - lo + 1);
+
+	int slot = slot_of(wl,wb->wid);
+	wl->slots[slot] = *wb;
+	wl->bits[slot >> 6] |= 1ULL << (slot & 63);
+	wl->lo = lo;
+	wl->hi = hi;
+	wl->count++;
+	return true;
+}
+
+struct write_block *
+WLogGet(WLog *wl, int wid)
+{
+	assert(wl);
+	if (!wl->count || wid < wl->lo || wid > wl->hi)
+		return NULL;
+	int slot = slot_of(wl,wid);
+	return has_slot(wl,slot) ? &wl->slots[slot] : NULL;
+}
+
+void
+WLogTrim(WLog *wl, int wid)
+{
+	assert(wl);
+	if (!wl->count || wid <= wl->lo)
+		return;
+
+	int last = wid - 1 < wl->hi ? wid - 1 : wl->hi;
+	for (int cur = next_held(wl,wl->lo,last); cur <= last;
+			 cur = next_held(wl,cur + 1,last)) {
+		int slot = slot_of(wl,cur);
+		wbfree(&wl->slots[slot]);
+		wl->bits[slot >> 6] &= ~(1ULL << (slot & 63));
+		wl->count--;
+	}
+
+	if (wl->count)
+		wl->lo = next_held(wl,wid,wl->hi);
+	else
+		wl->hi = wl->lo - 1;
+}
+
+void
+WLogDrop(WLog *wl, int from_wid, int to_wid)
+{
+	assert(wl);
+	if (!wl->count || to_wid < wl->lo || from_wid > wl->hi)
+		return;
+
+	int first = from_wid > wl->lo ? from_wid : wl->lo;
+	int last = to_wid < wl->hi ? to_wid : wl->hi;
+	for (int cur = next_held(wl,first,last); cur <= last;
+			 cur = next_held(wl,cur + 1,last)) {
+		int slot = slot_of(wl,cur);
+		wbfree(&wl->slots[slot]);
+		wl->bits[slot >> 6] &= ~(1ULL << (slot & 63));
+		wl->count--;
+	}
+
+	if (!wl->count) {
+		wl->hi = wl->lo - 1;
+		return;
+	}
+	wl->lo = next_held(wl,wl->lo,wl->hi);
+	while (!has_slot(wl,slot_of(wl,wl->hi)))
+		wl->hi--;
+}
+
+WLog *
+WLogSplit(WLog *wl, int wid)
+{
+	assert(wl);
+	WLog *below = WLogCreate();
+	if (!wl->count || wid <= wl->lo)
+		return below;
+
+	int last = wid - 1 < wl->hi ? wid - 1 : wl->hi;
+	for (int cur = next_held(wl,wl->lo,last); cur <= last;
+			 cur = next_held(wl,cur + 1,last)) {
+		int slot = slot_of(wl,cur);
+		WLogInsert(below,&wl->slots[slot]);
+		wl->bits[slot >> 6] &= ~(1ULL << (slot & 63));
+		wl->count--;
+	}
+
+	if (wl->count)
+		wl->lo = next_held(wl,wid,wl->hi);
+	else
+		wl->hi = wl->lo - 1;
+	return below;
+}
+
+void
+WLogGaps(WLog *wl, int from_wid, int to_wid, WLogGapFn fn, void *aux)
+{
+	assert(wl);
+	if (from_wid > to_wid)
+		return;
+
+	if (!wl->count || to_wid < wl->lo || from_wid > wl->hi) {
+		fn(from_wid,to_wid,aux);
+		return;
+	}
+
+	/* the whole range is held */
+	if (from_wid >= wl->lo && to_wid <= wl->hi &&
+			wl->count == wl->hi - wl->lo + 1)
+		return;
+
+	if (from_wid < wl->lo)
+		fn(from_wid,wl->lo - 1,aux);
+
+	int first = from_wid > wl->lo ? from_wid : wl->lo;
+	int last = to_wid < wl->hi ? to_wid : wl->hi;
+	int cur = next_missing(wl,first,last);
+	while (cur <= last) {
+		int end = next_held(wl,cur,last);
+		fn(cur,end - 1,aux);
+		cur = next_missing(wl,end,last);
+	}
+
+	if (to_wid > wl->hi)
+		fn(wl->hi + 1,to_wid,aux);
+}
+
+struct write_block *
+WLogFirst(WLog *wl)
+{
+	assert(wl);
+	return wl->count ? WLogGet(wl,wl->lo) : NULL;
+}
+
+struct write_block *
+WLogNext(WLog *wl, struct write_block *wb)
+{
+	assert(wl);
+	if (!wb || wb->wid >= wl->hi)
+		return NULL;
+	return WLogGet(wl,next_held(wl,wb->wid + 1,wl->hi));
+}
@@ -0,0 +1,54 @@
+#ifndef __WLOG_H__
+#define __WLOG_H__
+
+#include <stdbool.h>
+#include "protocol.h"
+
+/*
+ * Staged write log indexed by wid. Blocks live in a ring of slots addressed
+ * by wid, with a bitmap of the wids received, so inserts and lookups are
+ * O(1) and gaps are found a 64-bit word at a time. The ring doubles when
+ * the span of held wids outgrows it, up to MAX_STAGED_WRITES: a wid
+ * further than that from the others is refused, not grown to.
+ */
+typedef struct wlog WLog;
+
+/* called once per run of missing wids, range is inclusive */
+typedef void (*WLogGapFn)(int from_wid, int to_wid, void *aux);
+
+WLog *WLogCreate();
+
+void WLogDispose(WLog *wl);
+
+int WLogCount(WLog *wl);
+
+/* whether a block of wid would keep the log within MAX_STAGED_WRITES */
+bool WLogFits(WLog *wl, int wid);
+
+/*
+ * Copies the block into the log, which takes ownership of wb->data.
+ * Returns false, without taking ownership, if the wid is already held
+ * or does not fit.
+ */
+bool WLogInsert(WLog *wl, struct write_block *wb);
+
+struct write_block *WLogGet(WLog *wl, int wid);
+
+/* frees every block below wid */
+void WLogTrim(WLog *wl, int wid);
+
+/* frees every block in [from_wid,to_wid] */
+void WLogDrop(WLog *wl, int from_wid, int to_wid);
+
+/* moves every block below wid, and its data, into a new log */
+WLog *WLogSplit(WLog *wl, int wid);
+
+/* reports the runs of wids in [from_wid,to_wid] that are not held */
+void WLogGaps(WLog *wl, int from_wid, int to_wid, WLogGapFn fn, void *aux);
+
+/* iteration in wid order, the log must not change in the midst of it */
+struct write_block *WLogFirst(WLog *wl);
+
+struct write_block *WLogNext(WLog *wl, struct write_block *wb);
+
+#endif